@@ -0,0 +1,56 @@
+#pragma once
+
+#include "httplib.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+
+// Thrown when a bounded queue is full; handlers answer 503 right away.
+struct Overloaded : std::runtime_error {
+    Overloaded() : std::runtime_error("Server overloaded") {}
+};
+
+// Connection task queue for httplib::Server::new_task_queue. Connections are
+// served by a fixed pool with a bounded backlog. When the backlog is full the
+// connection is handed to a single "rejecter" thread instead, which runs the
+// normal request parsing with rejecting() set; the pre-routing handler then
+// answers 503 and closes the connection without touching any route. Only if
+// the rejecter's own small backlog is full is the socket dropped outright.
+class AdmissionTaskQueue : public httplib::TaskQueue {
+public:
+    AdmissionTaskQueue(std::size_t threads, std::size_t max_queued, std::size_t max_rejecting = 64)
+        : workers(threads, max_queued), rejecter(1, max_rejecting) {}
+
+    bool enqueue(std::function<void()> fn) override {
+        if (workers.enqueue(fn)) {
+            return true;
+        }
+        rejected_count()++;
+        return rejecter.enqueue([fn] {
+            rejecting() = true;
+            fn();
+            rejecting() = false;
+        });
+    }
+
+    void shutdown() override {
+        workers.shutdown();
+        rejecter.shutdown();
+    }
+
+    // True on the rejecter thread while it handles an over-capacity connection.
+    static bool& rejecting() {
+        thread_local bool value = false;
+        return value;
+    }
+
+    static std::atomic<std::uint64_t>& rejected_count() {
+        static std::atomic<std::uint64_t> count{0};
+        return count;
+    }
+
+private:
+    httplib::ThreadPool workers;
+    httplib::ThreadPool rejecter;
+};
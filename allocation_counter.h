@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// Counts operator new calls made by the current thread, so a code path can be
+// checked for heap allocations (see `myserver check_allocations`). This
+// replaces the global allocation functions and must therefore be included by
+// exactly one translation unit, main.cpp. Eigen allocates with malloc rather
+// than new; its allocations are checked with EIGEN_RUNTIME_NO_MALLOC instead.
+inline std::uint64_t& thread_allocation_count() {
+    thread_local std::uint64_t count = 0;
+    return count;
+}
+
+inline void* counted_allocate(std::size_t size, std::size_t alignment) {
+    thread_allocation_count()++;
+    void* ptr = nullptr;
+    if (alignment <= alignof(std::max_align_t)) {
+        ptr = std::malloc(size ? size : 1);
+    } else if (posix_memalign(&ptr, alignment, size ? size : 1) != 0) {
+        ptr = nullptr;
+    }
+    return ptr;
+}
+
+// Kept out of line so the compiler does not pair the free() with the
+// operator new it can see and warn about a mismatched deallocation.
+[[gnu::noinline]] inline void counted_free(void* ptr) noexcept { std::free(ptr); }
+
+void* operator new(std::size_t size) {
+    if (void* ptr = counted_allocate(size, 0)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return counted_allocate(size, 0); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return counted_allocate(size, 0); }
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    if (void* ptr = counted_allocate(size, static_cast<std::size_t>(alignment))) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) { return operator new(size, alignment); }
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return counted_allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return counted_allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept { counted_free(ptr); }
+void operator delete[](void* ptr) noexcept { counted_free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { counted_free(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { counted_free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { counted_free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { counted_free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { counted_free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { counted_free(ptr); }
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept { counted_free(ptr); }
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept { counted_free(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { counted_free(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { counted_free(ptr); }
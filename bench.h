@@ -0,0 +1,488 @@
+#pragma once
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+#include <Eigen/Dense>
+#include "httplib.h"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "admission.h"
+#include "allocation_counter.h"
+#include "corpus.h"
+#include "epoll_server.h"
+#include "metric.h"
+#include "query_engine.h"
+#include "segments.h"
+#include "wal.h"
+
+// `myserver bench_scan --rows N --dim D --iters I`
+// Scores a random corpus with the pre-Corpus column-major MatrixXf scan and
+// with the row-major Corpus kernels, and prints time per scan and the rate at
+// which corpus bytes are streamed.
+inline int run_bench_scan(Eigen::Index rows, Eigen::Index dim, int iters) {
+    std::cout << "bench_scan rows=" << rows << " dim=" << dim << " iters=" << iters << "\n";
+
+    Eigen::MatrixXf column_major = Eigen::MatrixXf::Random(rows, dim);
+    Eigen::VectorXf query = Eigen::VectorXf::Random(dim);
+
+    Corpus corpus(rows, dim);
+    for (Eigen::Index i = 0; i < rows; ++i) {
+        Eigen::VectorXf::Map(corpus.row(i), dim) = column_major.row(i);
+    }
+    std::cout << "corpus backing: " << page_backing_name(corpus.backing()) << ", "
+              << corpus.huge_page_bytes() / (1 << 20) << " of " << corpus.bytes() / (1 << 20) << " MB on huge pages\n";
+    RowStats stats = RowStats::compute(corpus);
+    ScanKernels kernels = ScanKernels::for_stride(corpus.stride());
+    Eigen::VectorXf padded_query = corpus.pad_query(query);
+    Eigen::VectorXf cosine_query = padded_query;
+    CosineMetric::prepare_query(cosine_query);
+    Eigen::VectorXf scores(rows);
+
+    const double corpus_bytes = static_cast<double>(rows) * dim * sizeof(float);
+    auto report = [&](const char* name, auto&& scan) {
+        scan();
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iters; ++i) {
+            scan();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / iters;
+        std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(3)
+                  << std::setw(10) << seconds * 1e3 << " ms" << std::setw(10) << corpus_bytes / seconds / 1e9 << " GB/s\n";
+    };
+
+    report("colmajor cosine (renorm)", [&] {
+        Eigen::MatrixXf embeddings_norm = column_major.rowwise().normalized();
+        scores.noalias() = embeddings_norm * query.normalized();
+    });
+    report("colmajor dot", [&] { scores.noalias() = column_major * query; });
+    report("colmajor l1", [&] { scores = (column_major.rowwise() - query.transpose()).cwiseAbs().rowwise().sum(); });
+
+    report("corpus cosine", [&] { kernels.get<CosineMetric>()(corpus, stats, cosine_query, 0, ScoresView(scores.data(), rows)); });
+    report("corpus dot", [&] { kernels.get<DotMetric>()(corpus, stats, padded_query, 0, ScoresView(scores.data(), rows)); });
+    report("corpus euclidean", [&] { kernels.get<EuclideanMetric>()(corpus, stats, padded_query, 0, ScoresView(scores.data(), rows)); });
+    report("corpus l1", [&] { kernels.get<L1Metric>()(corpus, stats, padded_query, 0, ScoresView(scores.data(), rows)); });
+    return 0;
+}
+
+// `myserver check_allocations --rows N --dim D --topk K --queries Q`
+// Checks that steady-state queries do no heap allocation. For every metric a
+// warm-up first page grows this thread's QueryScratch; the next Q queries
+// then fetch the second page through a cursor (cosine+mmr repeats a
+// diversified first page instead), with operator new counted and
+// Eigen's allocator switched off
+// (EIGEN_RUNTIME_NO_MALLOC asserts on any Eigen allocation). Exits nonzero if
+// any metric allocated.
+inline int run_check_allocations(Eigen::Index rows, Eigen::Index dim, int topk, int queries) {
+    std::cout << "check_allocations rows=" << rows << " dim=" << dim << " topk=" << topk << " queries=" << queries << "\n";
+
+    Corpus corpus(rows, dim);
+    StringTable paths;
+    for (Eigen::Index i = 0; i < rows; ++i) {
+        Eigen::VectorXf::Map(corpus.row(i), dim) = Eigen::VectorXf::Random(dim);
+        paths.push_back("row" + std::to_string(i));
+    }
+    QueryEngine engine(std::move(corpus), std::move(paths));
+    QueryRequest request;
+    request.embedding = Eigen::VectorXf::Random(dim);
+    request.topk = topk;
+    QueryScratch& scratch = QueryScratch::local();
+
+    int failures = 0;
+    for (const char* mode : {"cosine", "dot", "euclidean", "l1", "cosine+mmr"}) {
+        bool mmr = std::string_view(mode) == "cosine+mmr";
+        request.metric = mmr ? Metric::Cosine : parse_metric(mode);
+        request.after.reset();
+        if (mmr) {
+            request.diversify.emplace();
+        }
+        engine.query(request, scratch);
+        if (!mmr) {
+            request.after = Cursor::after(scratch.results.back());
+        }
+        engine.query(request, scratch);
+
+        std::uint64_t before = thread_allocation_count();
+        Eigen::internal::set_is_malloc_allowed(false);
+        for (int i = 0; i < queries; ++i) {
+            engine.query(request, scratch);
+        }
+        Eigen::internal::set_is_malloc_allowed(true);
+        std::uint64_t allocations = thread_allocation_count() - before;
+
+        std::cout << std::left << std::setw(12) << mode << allocations << " allocations\n";
+        failures += allocations > 0;
+    }
+    return failures > 0 ? 1 : 0;
+}
+
+// `myserver check_segments --rows N --dim D --groups G`
+// Checks that a collection sharded over two simulated NUMA partitions stays
+// correct as it is mutated. G random groups of upserts and deletes are
+// applied, each followed by every merge plan_merge asks for; the engine must
+// then still have its partition workers and both untouched partition shards,
+// and query and query_batch must return the cosine top-k of a brute-force
+// scan over the live rows.
+inline int run_check_segments(Eigen::Index rows, Eigen::Index dim, int groups) {
+    std::cout << "check_segments rows=" << rows << " dim=" << dim << " groups=" << groups << "\n";
+    const int topk = 10;
+    NumaTopology topology = simulate_partitions(detect_numa_topology(), 2);
+    std::map<std::string, Eigen::VectorXf> live;
+    std::vector<std::pair<Corpus, StringTable>> sharded;
+    for (std::size_t p = 0; p < topology.partitions.size(); ++p) {
+        Eigen::Index begin = rows * p / topology.partitions.size();
+        Eigen::Index end = rows * (p + 1) / topology.partitions.size();
+        Corpus corpus(end - begin, dim);
+        StringTable paths;
+        for (Eigen::Index i = begin; i < end; ++i) {
+            std::string file = "row" + std::to_string(i);
+            live[file] = Eigen::VectorXf::Random(dim);
+            Eigen::VectorXf::Map(corpus.row(i - begin), dim) = live[file];
+            std::fill(corpus.row(i - begin) + dim, corpus.row(i - begin) + corpus.stride(), 0.0f);
+            paths.push_back(file);
+        }
+        sharded.emplace_back(std::move(corpus), std::move(paths));
+    }
+    std::shared_ptr<const QueryEngine> engine = std::make_shared<QueryEngine>(std::move(sharded), topology);
+    std::vector<std::shared_ptr<const Segment>> partition_segments;
+    for (const auto& shard : engine->corpus_shards()) {
+        partition_segments.push_back(shard.segment);
+    }
+    SegmentOptions options;
+    options.memtable_rows = 64;
+    options.merge_factor = 2;
+
+    int failures = 0;
+    auto expect = [&](bool ok, int group, const char* what) {
+        if (!ok) {
+            std::cout << "FAIL  group " << group << ": " << what << "\n";
+            failures++;
+        }
+    };
+    std::mt19937 random(7);
+    int next_file = 0;
+    std::size_t merges = 0;
+    for (int g = 0; g < groups; ++g) {
+        std::vector<Mutation> mutations(40);
+        for (Mutation& mutation : mutations) {
+            auto existing = std::next(live.begin(), random() % live.size());
+            if (random() % 10 < 3 && live.size() > 1) {
+                mutation.kind = Mutation::Kind::Delete;
+                mutation.file = existing->first;
+                live.erase(existing);
+                continue;
+            }
+            mutation.file = random() % 2 ? existing->first : "new" + std::to_string(next_file++);
+            mutation.embedding = Eigen::VectorXf::Random(dim);
+            live[mutation.file] = mutation.embedding;
+        }
+        engine = apply_mutations(*engine, mutations, options);
+        while (auto plan = plan_merge(*engine, options)) {
+            const auto& shards = engine->corpus_shards();
+            std::vector<QueryEngine::Shard> sources(shards.begin() + plan->begin, shards.begin() + plan->end);
+            bool partition_planned =
+                std::any_of(sources.begin(), sources.end(), [](const QueryEngine::Shard& shard) { return shard.segment->partition >= 0; });
+            expect(!partition_planned, g, "partition shard planned for a merge");
+            if (partition_planned) {
+                break;
+            }
+            engine = replace_segments(*engine, sources, merge_segments(sources, dim));
+            merges++;
+        }
+
+        expect(engine->partition_workers() != nullptr, g, "partition workers dropped");
+        std::size_t kept = 0;
+        for (const auto& shard : engine->corpus_shards()) {
+            kept += std::count(partition_segments.begin(), partition_segments.end(), shard.segment);
+        }
+        expect(kept == partition_segments.size(), g, "partition shard merged away");
+
+        std::vector<QueryRequest> requests(3);
+        for (QueryRequest& request : requests) {
+            request.embedding = Eigen::VectorXf::Random(dim);
+            request.topk = topk;
+        }
+        auto batch = engine->query_batch(requests);
+        for (std::size_t q = 0; q < requests.size(); ++q) {
+            std::vector<std::pair<float, std::string>> reference;
+            for (const auto& [file, embedding] : live) {
+                reference.emplace_back(-embedding.dot(requests[q].embedding) / embedding.norm() / requests[q].embedding.norm(), file);
+            }
+            std::sort(reference.begin(), reference.end());
+            const QueryResults& results = engine->query(requests[q], QueryScratch::local());
+            bool same = results.size() == topk && !batch[q].error && batch[q].results.size() == topk;
+            // Scores are compared rather than files, which near-ties may swap.
+            for (int i = 0; same && i < topk; ++i) {
+                float score = -reference[i].first;
+                same = live.count(std::string(results[i].file)) && std::abs(results[i].score - score) < 1e-4f &&
+                       live.count(std::string(batch[q].results[i].file)) && std::abs(batch[q].results[i].score - score) < 1e-4f;
+            }
+            expect(same, g, "top-k differs from brute force");
+        }
+    }
+    std::cout << "shards=" << engine->corpus_shards().size() << " merges=" << merges << " live=" << live.size()
+              << (failures > 0 ? " FAIL\n" : " ok\n");
+    return failures > 0 ? 1 : 0;
+}
+
+#ifdef __linux__
+// `myserver check_wal --dir D`
+// Checks that a group the write-ahead log fails to write leaves no trace.
+// Logs a group, then caps the file size (RLIMIT_FSIZE, with SIGXFSZ
+// ignored) so the next group is written only in part and fails with EFBIG,
+// logs a different group under the same sequence numbers, and replays the
+// log from D/wal: it must hold exactly the first and the last group.
+inline int run_check_wal(const std::string& dir) {
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    std::string path = dir + "/wal";
+    auto group = [](const std::string& prefix, Eigen::Index dim) {
+        std::vector<Mutation> mutations(2);
+        for (std::size_t i = 0; i < mutations.size(); ++i) {
+            mutations[i].file = prefix + std::to_string(i);
+            mutations[i].embedding = Eigen::VectorXf::Random(dim);
+        }
+        return mutations;
+    };
+
+    int failures = 0;
+    auto expect = [&](bool ok, const char* what) {
+        std::cout << (ok ? "ok    " : "FAIL  ") << what << "\n";
+        failures += !ok;
+    };
+    {
+        WriteAheadLog wal(path);
+        wal.append(group("first", 8), 1);
+        std::size_t good = wal.bytes();
+
+        rlimit limit;
+        ::getrlimit(RLIMIT_FSIZE, &limit);
+        rlimit capped = limit;
+        capped.rlim_cur = good + 64;
+        auto previous = std::signal(SIGXFSZ, SIG_IGN);
+        ::setrlimit(RLIMIT_FSIZE, &capped);
+        bool threw = false;
+        try {
+            wal.append(group("lost", 1024), 3);
+        } catch (const std::system_error&) {
+            threw = true;
+        }
+        ::setrlimit(RLIMIT_FSIZE, &limit);
+        std::signal(SIGXFSZ, previous);
+
+        expect(threw, "failed append throws");
+        expect(std::filesystem::file_size(path) == good && wal.bytes() == good, "failed append is cut off");
+        expect(!wal.failed(), "log still accepts appends");
+        wal.append(group("second", 8), 3);
+    }
+
+    auto records = WriteAheadLog::replay(path, 0);
+    const char* files[] = {"first0", "first1", "second0", "second1"};
+    bool replayed = records.size() == 4;
+    for (std::size_t i = 0; replayed && i < records.size(); ++i) {
+        replayed = records[i].first == i + 1 && records[i].second.file == files[i];
+    }
+    expect(replayed, "replay holds both good groups in sequence");
+    std::filesystem::remove_all(dir);
+    return failures > 0 ? 1 : 0;
+}
+
+
+// One keep-alive client of bench_connections.
+struct BenchClient {
+    int fd = -1;
+    bool connecting = false;
+    std::string in;
+    int status = 0;
+    bool close = false;
+    double latency_ms = 0;
+};
+
+// Sends one GET /health on every client at once and waits for all answers
+// or `timeout`. Clients without an open connection connect first; failed,
+// timed out and "Connection: close" clients are closed for the next round.
+inline void bench_connections_round(std::vector<BenchClient>& clients, int port, std::chrono::seconds timeout) {
+    const std::string request = "GET /health HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    auto start = std::chrono::steady_clock::now();
+    std::size_t pending = 0;
+    for (std::size_t i = 0; i < clients.size(); ++i) {
+        BenchClient& client = clients[i];
+        client.in.clear();
+        client.status = 0;
+        if (client.fd < 0) {
+            client.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            client.connecting = connect(client.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0;
+        }
+        epoll_event event{};
+        event.events = EPOLLOUT;
+        event.data.u64 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client.fd, &event);
+        pending++;
+    }
+
+    auto finish = [&](BenchClient& client, int status) {
+        client.status = status;
+        client.latency_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client.fd, nullptr);
+        if (status <= 0 || client.close) {
+            close(client.fd);
+            client.fd = -1;
+        }
+        pending--;
+    };
+
+    epoll_event events[256];
+    while (pending > 0) {
+        auto left = timeout - (std::chrono::steady_clock::now() - start);
+        if (left <= std::chrono::seconds(0)) {
+            break;
+        }
+        int n = epoll_wait(epoll_fd, events, 256, std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1);
+        for (int e = 0; e < n; ++e) {
+            BenchClient& client = clients[events[e].data.u64];
+            if (events[e].events & EPOLLOUT) {
+                int error = 0;
+                socklen_t len = sizeof(error);
+                getsockopt(client.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+                client.connecting = false;
+                if (error != 0 || send(client.fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+                    finish(client, -1);
+                    continue;
+                }
+                epoll_event event{};
+                event.events = EPOLLIN;
+                event.data.u64 = events[e].data.u64;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client.fd, &event);
+                continue;
+            }
+
+            char buffer[4096];
+            ssize_t got = recv(client.fd, buffer, sizeof(buffer), 0);
+            if (got <= 0) {
+                finish(client, -1);
+                continue;
+            }
+            client.in.append(buffer, got);
+            std::size_t header_end = client.in.find("\r\n\r\n");
+            if (header_end == std::string::npos) {
+                continue;
+            }
+            std::string head = client.in.substr(0, header_end);
+            std::transform(head.begin(), head.end(), head.begin(), ::tolower);
+            std::size_t length_at = head.find("content-length:");
+            std::size_t length = length_at == std::string::npos ? 0 : std::stoul(head.substr(length_at + 15));
+            if (client.in.size() >= header_end + 4 + length) {
+                client.close = head.find("connection: close") != std::string::npos;
+                finish(client, std::stoi(head.substr(9, 3)));
+            }
+        }
+    }
+
+    for (auto& client : clients) {
+        if (client.status == 0 && client.fd >= 0) {
+            close(client.fd);
+            client.fd = -1;
+        }
+    }
+    close(epoll_fd);
+}
+
+// `myserver bench_connections --connections N --threads T --io_threads I`
+// Serves GET /health with the httplib front end (AdmissionTaskQueue with T
+// workers, as `serve` runs it) and with EpollServer (I event loops, T
+// workers), and has N concurrent keep-alive clients send one request per
+// round. Reports per round how many clients got 200, 503, an error or no
+// answer within --timeout_s, and the latency percentiles of the 200s.
+inline int run_bench_connections(int connections, int threads, int io_threads, int max_queued, int rounds, int timeout_s) {
+    std::cout << "bench_connections connections=" << connections << " threads=" << threads << " io_threads=" << io_threads
+              << " max_queued=" << max_queued << "\n";
+    auto health = [](const httplib::Request&, httplib::Response& res) { res.set_content("OK", "text/plain"); };
+    auto overloaded = [](const httplib::Request&, httplib::Response& res) {
+        res.status = 503;
+        res.set_header("Connection", "close");
+    };
+
+    auto run = [&](const char* name, auto& server) {
+        server.Get("/health", health);
+        int port = server.bind_to_any_port("127.0.0.1");
+        std::thread listener([&] { server.listen_after_bind(); });
+        while (!server.is_running()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        std::vector<BenchClient> clients(connections);
+        for (int round = 0; round < rounds; ++round) {
+            auto start = std::chrono::steady_clock::now();
+            bench_connections_round(clients, port, std::chrono::seconds(timeout_s));
+            double wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+            int ok = 0, rejected = 0, failed = 0, timed_out = 0;
+            std::vector<double> latencies;
+            for (const auto& client : clients) {
+                if (client.status == 200) {
+                    ok++;
+                    latencies.push_back(client.latency_ms);
+                } else if (client.status == 503) {
+                    rejected++;
+                } else if (client.status == 0) {
+                    timed_out++;
+                } else {
+                    failed++;
+                }
+            }
+            std::sort(latencies.begin(), latencies.end());
+            auto percentile = [&](double p) {
+                return latencies.empty() ? 0.0 : latencies[std::min(latencies.size() - 1, static_cast<std::size_t>(p * latencies.size()))];
+            };
+            std::cout << std::left << std::setw(8) << name << " round " << round << std::right << std::fixed << std::setprecision(1)
+                      << "  ok " << std::setw(6) << ok << "  503 " << std::setw(6) << rejected << "  error " << std::setw(6) << failed
+                      << "  timeout " << std::setw(6) << timed_out << "  p50 " << std::setw(8) << percentile(0.5) << " ms  p99 "
+                      << std::setw(8) << percentile(0.99) << " ms  wall " << std::setw(8) << wall_ms << " ms\n";
+        }
+        for (auto& client : clients) {
+            if (client.fd >= 0) {
+                close(client.fd);
+            }
+        }
+        server.stop();
+        listener.join();
+    };
+
+    {
+        httplib::Server server;
+        server.new_task_queue = [=] { return new AdmissionTaskQueue(threads, max_queued); };
+        server.set_pre_routing_handler([&](const httplib::Request& req, httplib::Response& res) {
+            if (!AdmissionTaskQueue::rejecting()) {
+                return httplib::Server::HandlerResponse::Unhandled;
+            }
+            overloaded(req, res);
+            return httplib::Server::HandlerResponse::Handled;
+        });
+        run("httplib", server);
+    }
+    {
+        EpollServer server(io_threads, threads, max_queued);
+        server.set_overload_handler(overloaded);
+        run("epoll", server);
+    }
+    return 0;
+}
+
+#endif  // __linux__
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "admission.h"
+#include "json_writer.h"
+#include "kmeans.h"
+#include "query_engine.h"
+#include "segments.h"
+
+// Background k-means jobs for POST /cluster. Jobs run one at a time on a
+// dedicated thread, fanning out to `threads` threads of their own, so
+// clustering never occupies connection or query workers. At most
+// `max_queued` jobs wait (beyond that submit() throws Overloaded), progress
+// is published after every iteration, and the last `max_kept` finished jobs
+// stay available for polling. Each job holds the engine it was submitted
+// for, so a reload of the corpus does not pull it out from under the job;
+// an engine with deleted rows is first copied without them.
+class ClusterJobs {
+public:
+    struct Status {
+        std::string state;  // queued, running, done or failed
+        int iteration = 0;
+        int max_iterations = 0;
+        std::size_t moved = 0;
+        std::string error;
+        std::shared_ptr<const std::string> result;  // JSON members of a finished job
+    };
+
+    ClusterJobs(int threads, std::size_t max_queued = 4, std::size_t max_kept = 16)
+        : threads(threads), max_queued(max_queued), max_kept(max_kept) {
+        worker = std::thread([this] { run_loop(); });
+    }
+
+    ClusterJobs(const ClusterJobs&) = delete;
+    ClusterJobs& operator=(const ClusterJobs&) = delete;
+
+    // Cancels the running job at its next iteration.
+    ~ClusterJobs() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shutdown = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    std::string submit(std::shared_ptr<const QueryEngine> engine, KMeansOptions options) {
+        options.threads = threads;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (queue.size() >= max_queued) {
+            throw Overloaded();
+        }
+        std::string id = std::to_string(next_id++);
+        Status& status = jobs[id];
+        status.state = "queued";
+        status.max_iterations = options.max_iterations;
+        queue.push_back({id, std::move(engine), options});
+        cv.notify_one();
+        return id;
+    }
+
+    std::optional<Status> status(const std::string& id) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = jobs.find(id);
+        if (it == jobs.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+private:
+    struct Job {
+        std::string id;
+        std::shared_ptr<const QueryEngine> engine;
+        KMeansOptions options;
+    };
+
+    int threads;
+    std::size_t max_queued;
+    std::size_t max_kept;
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Job> queue;
+    std::unordered_map<std::string, Status> jobs;
+    std::deque<std::string> finished;
+    std::uint64_t next_id = 1;
+    bool shutdown = false;
+    std::thread worker;
+
+    void run_loop() {
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return shutdown || !queue.empty(); });
+                if (shutdown) {
+                    return;
+                }
+                job = std::move(queue.front());
+                queue.pop_front();
+                jobs[job.id].state = "running";
+            }
+            const std::string& id = job.id;
+
+            std::shared_ptr<const std::string> result;
+            std::string error;
+            try {
+                job.engine = without_deleted_rows(std::move(job.engine));
+                KMeansResult clusters = kmeans(*job.engine, job.options, [&](int iteration, std::size_t moved) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    Status& status = jobs[id];
+                    status.iteration = iteration;
+                    status.moved = moved;
+                    return !shutdown;
+                });
+                result = std::make_shared<const std::string>(result_json(*job.engine, clusters));
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            Status& status = jobs[id];
+            status.state = result ? "done" : "failed";
+            status.result = result;
+            status.error = error;
+            finished.push_back(id);
+            while (finished.size() > max_kept) {
+                jobs.erase(finished.front());
+                finished.pop_front();
+            }
+        }
+    }
+
+    // "iterations", "converged", "inertia", "sizes", "centroids" and
+    // "assignments" ({"file", "cluster"} per row), written without a DOM
+    // since a corpus-wide assignment list is large.
+    static std::string result_json(const QueryEngine& engine, const KMeansResult& clusters) {
+        std::string body;
+        body.reserve(clusters.assignments.size() * 64 + clusters.centroids.size() * 12);
+        JsonWriter json(body);
+        json.raw("\"iterations\":").integer(clusters.iterations);
+        json.raw(",\"converged\":").raw(clusters.converged ? "true" : "false");
+        json.raw(",\"inertia\":").number(static_cast<float>(clusters.inertia));
+        json.raw(",\"sizes\":[");
+        for (std::size_t c = 0; c < clusters.sizes.size(); ++c) {
+            json.raw(c == 0 ? "" : ",").integer(clusters.sizes[c]);
+        }
+        json.raw("],\"centroids\":[");
+        for (Eigen::Index c = 0; c < clusters.centroids.rows(); ++c) {
+            json.raw(c == 0 ? "[" : ",[");
+            for (Eigen::Index d = 0; d < clusters.centroids.cols(); ++d) {
+                json.raw(d == 0 ? "" : ",").number(clusters.centroids(c, d));
+            }
+            json.raw("]");
+        }
+        json.raw("],\"assignments\":[");
+        for (std::size_t i = 0; i < clusters.assignments.size(); ++i) {
+            json.raw(i == 0 ? "{\"file\":" : ",{\"file\":").string(engine.image_path(i));
+            json.raw(",\"cluster\":").integer(clusters.assignments[i]).raw("}");
+        }
+        json.raw("]");
+        return body;
+    }
+};
@@ -0,0 +1,672 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "metric.h"
+#include "mutation_store.h"
+#include "query_engine.h"
+#include "segments.h"
+
+// One generation of a named corpus served under /collections/{name}: its
+// engine, the metric its queries use unless they give a "mode", and where it
+// was loaded from. A generation is immutable; a reload or a group of
+// upserts and deletes builds the next one and swaps it in whole. `id` is
+// unique per generation, so cached results of an older generation are never
+// served for a newer one.
+struct Collection {
+    std::string name;
+    std::uint64_t id = 0;
+    std::uint64_t generation = 1;
+    std::string path;
+    std::string index;  // only "flat", the exact scan, exists
+    Metric metric = Metric::Cosine;
+    std::uint64_t source_stamp = 0;  // of `path` when the load started
+    std::shared_ptr<const QueryEngine> engine;
+};
+
+// The current generation of one name. Readers take it with one atomic load
+// and never wait on a reload, which replaces it with one atomic store; the
+// old generation is freed when the last query holding it finishes.
+struct CollectionSlot {
+    std::shared_ptr<const Collection> current;
+
+    std::shared_ptr<const Collection> load() const { return std::atomic_load(&current); }
+};
+
+struct CollectionConflict : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+struct CollectionBudgetExceeded : std::runtime_error {
+    CollectionBudgetExceeded() : std::runtime_error("Collection memory budget exceeded") {}
+};
+
+// The collections of one server process. They share its connection and
+// query pools and one memory budget for their corpora (0 for unlimited).
+// Collections are handed out as shared_ptr, so dropping one only unlists
+// it: queries already running keep it alive until they finish.
+//
+// Reloads run on one background thread: reload() queues a name, and with a
+// watch interval the thread also reloads every collection whose directory
+// changed (file count, sizes or modification times) since its last load.
+// The new generation is loaded next to the old one, so both corpora are
+// resident until the swap and the old one's last queries finish; the report
+// of each reload gives the load time, the swap latency, those overlapping
+// bytes and how long the old generation outlived the swap.
+//
+// Upserts and deletes go through a MutationStore per collection, in a
+// subdirectory of the durability directory named after the collection,
+// created by the first mutation. Each committed group becomes a new
+// generation laid out in segments (see segments.h), which one background
+// thread merges as they accumulate; a reload replays the store's overlay
+// over the freshly loaded files, and adding a collection whose
+// subdirectory exists recovers it, so mutations survive reloads and
+// restarts. Dropping a collection deletes its mutations. The memory budget
+// is checked when collections are added or reloaded, not per mutation.
+class CollectionRegistry {
+public:
+    using Loader = std::function<std::unique_ptr<QueryEngine>(const std::string& directory)>;
+
+    struct ReloadStatus {
+        std::string state = "idle";  // idle, queued, loading or failed
+        std::string error;
+        std::uint64_t reloads = 0;
+        double load_ms = 0;
+        double swap_us = 0;
+        std::size_t overlap_bytes = 0;
+        double retired_after_ms = -1;  // -1 while the old generation is alive
+    };
+
+    CollectionRegistry(Loader loader, std::size_t max_bytes, std::chrono::seconds watch_interval = std::chrono::seconds(0),
+                       MutationStore::Options durability = MutationStore::Options(), SegmentOptions segment_options = SegmentOptions())
+        : loader(std::move(loader)), max_bytes(max_bytes), watch_interval(watch_interval), durability(std::move(durability)),
+          segment_options(segment_options), retired(std::make_shared<RetireLog>()) {
+        worker = std::thread([this] { reload_loop(); });
+        merger = std::thread([this] { merge_loop(); });
+    }
+
+    CollectionRegistry(const CollectionRegistry&) = delete;
+    CollectionRegistry& operator=(const CollectionRegistry&) = delete;
+
+    // Mutations still queued are committed but no longer applied.
+    ~CollectionRegistry() {
+        std::map<std::string, std::shared_ptr<Mutable>> stopping;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shutdown = true;
+            stopping.swap(mutables);
+        }
+        stopping.clear();
+        cv.notify_all();
+        merge_cv.notify_all();
+        worker.join();
+        merger.join();
+    }
+
+    // Adds an engine loaded elsewhere; it can be reloaded but not dropped.
+    std::shared_ptr<CollectionSlot> add_pinned(const std::string& name, const std::string& path, Metric metric,
+                                               std::unique_ptr<QueryEngine> engine) {
+        auto collection = make_collection(name, path, "flat", metric);
+        collection->source_stamp = directory_stamp(path);
+        collection->engine = std::move(engine);
+        auto entry = recover(name, collection->engine);
+        std::lock_guard<std::mutex> lock(mutex);
+        bytes += collection->engine->corpus_bytes();
+        pinned.insert(name);
+        auto slot = std::make_shared<CollectionSlot>();
+        slot->current = std::move(collection);
+        mutables[name] = std::move(entry);
+        return slots[name] = slot;
+    }
+
+    // Loads the embedding files under `path`, a directory relative to the
+    // working directory, as collection `name`. The load runs outside the lock,
+    // so other collections keep serving meanwhile.
+    std::shared_ptr<const Collection> create(const std::string& name, const std::string& path, Metric metric, const std::string& index) {
+        if (!valid_name(name)) {
+            throw std::invalid_argument("Collection names are 1 to 64 letters, digits, '-' or '_'");
+        }
+        std::filesystem::path directory(path);
+        if (path.empty() || directory.is_absolute() ||
+            std::any_of(directory.begin(), directory.end(), [](const std::filesystem::path& part) { return part == ".."; })) {
+            throw std::invalid_argument("path must be a relative directory without '..'");
+        }
+        if (!std::filesystem::is_directory(directory)) {
+            throw std::invalid_argument("Not a directory: " + path);
+        }
+        if (index != "flat") {
+            throw std::invalid_argument("Unsupported index: " + index);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (slots.count(name) || loading.count(name)) {
+                throw CollectionConflict("Collection exists: " + name);
+            }
+            loading.insert(name);
+        }
+
+        auto collection = make_collection(name, path, index, metric);
+        std::shared_ptr<Mutable> entry;
+        try {
+            collection->source_stamp = directory_stamp(path);
+            collection->engine = load(path);
+            entry = recover(name, collection->engine);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            loading.erase(name);
+            throw;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        loading.erase(name);
+        std::size_t collection_bytes = collection->engine->corpus_bytes();
+        if (max_bytes > 0 && bytes + collection_bytes > max_bytes) {
+            throw CollectionBudgetExceeded();
+        }
+        bytes += collection_bytes;
+        auto slot = std::make_shared<CollectionSlot>();
+        slot->current = collection;
+        slots[name] = slot;
+        mutables[name] = std::move(entry);
+        return collection;
+    }
+
+    // Queues a reload of `name` from its path; false if there is no such
+    // collection.
+    bool reload(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!slots.count(name)) {
+            return false;
+        }
+        ReloadStatus& status = reload_status[name];
+        if (status.state != "queued" && status.state != "loading") {
+            status.state = "queued";
+            reload_queue.push_back(name);
+            cv.notify_all();
+        }
+        return true;
+    }
+
+    // False if there is no such collection.
+    bool drop(const std::string& name) {
+        std::shared_ptr<Mutable> entry;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = slots.find(name);
+            if (it == slots.end()) {
+                return false;
+            }
+            if (pinned.count(name)) {
+                throw CollectionConflict("Collection can not be dropped: " + name);
+            }
+            bytes -= it->second->load()->engine->corpus_bytes();
+            slots.erase(it);
+            reload_status.erase(name);
+            auto mutable_it = mutables.find(name);
+            entry = std::move(mutable_it->second);
+            mutables.erase(mutable_it);
+        }
+        // The store's writer may be waiting for the lock to apply a group.
+        entry.reset();
+        std::error_code error;
+        std::filesystem::remove_all(store_directory(name), error);
+        return true;
+    }
+
+    // Makes `mutations` durable and visible in collection `name`, as one
+    // group with whatever else is being committed to it; returns the
+    // sequence number of the last one, or nullopt if there is no such
+    // collection.
+    std::optional<std::uint64_t> mutate(const std::string& name, std::vector<Mutation> mutations) {
+        std::shared_ptr<Mutable> entry;
+        std::shared_ptr<const Collection> current;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = mutables.find(name);
+            if (it == mutables.end()) {
+                return std::nullopt;
+            }
+            entry = it->second;
+            current = slots.at(name)->load();
+        }
+        for (const Mutation& mutation : mutations) {
+            if (mutation.file.empty()) {
+                throw std::invalid_argument("Mutations need a file");
+            }
+            if (mutation.kind == Mutation::Kind::Upsert && mutation.embedding.size() != current->engine->dim()) {
+                throw std::invalid_argument("Embedding size mismatch");
+            }
+        }
+        MutationStore* store;
+        {
+            std::lock_guard<std::mutex> apply_lock(entry->apply);
+            if (!entry->store) {
+                entry->store = open_store(*entry, name);
+            }
+            store = entry->store.get();
+        }
+        return store->commit(std::move(mutations));
+    }
+
+    // Log and checkpoint statistics of `name`, if it was ever mutated.
+    std::optional<MutationStore::Stats> mutation_status(const std::string& name) const {
+        std::shared_ptr<Mutable> entry;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = mutables.find(name);
+            if (it == mutables.end()) {
+                return std::nullopt;
+            }
+            entry = it->second;
+        }
+        std::lock_guard<std::mutex> apply_lock(entry->apply);
+        if (!entry->store) {
+            return std::nullopt;
+        }
+        return entry->store->status();
+    }
+
+    std::shared_ptr<const Collection> find(const std::string& name) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = slots.find(name);
+        return it == slots.end() ? nullptr : it->second->load();
+    }
+
+    std::vector<std::shared_ptr<const Collection>> list() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::shared_ptr<const Collection>> result;
+        for (const auto& entry : slots) {
+            result.push_back(entry.second->load());
+        }
+        return result;
+    }
+
+    ReloadStatus status(const std::string& name) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = reload_status.find(name);
+        if (it == reload_status.end()) {
+            return ReloadStatus();
+        }
+        ReloadStatus status = it->second;
+        auto swap = swaps.find(name);
+        if (swap != swaps.end() && status.retired_after_ms < 0) {
+            if (auto freed = retired->freed_at(swap->second.first)) {
+                status.retired_after_ms = std::chrono::duration<double, std::milli>(*freed - swap->second.second).count();
+            }
+        }
+        return status;
+    }
+
+    // Corpus bytes of the listed collections.
+    std::size_t total_bytes() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return bytes;
+    }
+
+private:
+    // When each generation was freed, written by the deleter of the last
+    // shared_ptr to it, which may outlive the registry.
+    struct RetireLog {
+        std::mutex mutex;
+        std::unordered_map<std::uint64_t, std::chrono::steady_clock::time_point> freed;
+
+        void record(std::uint64_t id) {
+            std::lock_guard<std::mutex> lock(mutex);
+            freed[id] = std::chrono::steady_clock::now();
+        }
+
+        std::optional<std::chrono::steady_clock::time_point> freed_at(std::uint64_t id) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = freed.find(id);
+            if (it == freed.end()) {
+                return std::nullopt;
+            }
+            return it->second;
+        }
+    };
+
+    // The mutation store of one collection, if it has one yet. `apply`
+    // orders the generations built from its groups against reloads.
+    struct Mutable {
+        std::mutex apply;
+        std::unique_ptr<MutationStore> store;
+    };
+
+    Loader loader;
+    std::size_t max_bytes;
+    std::chrono::seconds watch_interval;
+    MutationStore::Options durability;
+    SegmentOptions segment_options;
+    std::shared_ptr<RetireLog> retired;
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::map<std::string, std::shared_ptr<CollectionSlot>> slots;
+    std::set<std::string> loading;
+    std::set<std::string> pinned;
+    std::map<std::string, std::shared_ptr<Mutable>> mutables;  // same keys as slots
+    std::size_t bytes = 0;
+    std::atomic<std::uint64_t> next_id{1};
+    std::map<std::string, ReloadStatus> reload_status;
+    // Per name, the id of the generation replaced by the last reload and when.
+    std::map<std::string, std::pair<std::uint64_t, std::chrono::steady_clock::time_point>> swaps;
+    std::deque<std::string> reload_queue;
+    std::condition_variable merge_cv;
+    std::deque<std::string> merge_queue;
+    std::set<std::string> merge_queued;
+    bool shutdown = false;
+    std::thread worker;
+    std::thread merger;
+
+    std::shared_ptr<Collection> make_collection(const std::string& name, const std::string& path, const std::string& index, Metric metric) {
+        std::shared_ptr<Collection> collection(new Collection(), [retired = retired](Collection* c) {
+            retired->record(c->id);
+            delete c;
+        });
+        collection->name = name;
+        collection->id = next_id++;
+        collection->path = path;
+        collection->index = index;
+        collection->metric = metric;
+        return collection;
+    }
+
+    std::shared_ptr<const QueryEngine> load(const std::string& path) {
+        std::shared_ptr<const QueryEngine> engine = loader(path);
+        if (engine->size() == 0) {
+            throw std::invalid_argument("No embeddings in " + path);
+        }
+        return engine;
+    }
+
+    std::string store_directory(const std::string& name) const { return durability.directory + "/" + name; }
+
+    // Opens the store of `entry`, which publishes every committed group of
+    // mutations as the next generation of collection `name`.
+    std::unique_ptr<MutationStore> open_store(Mutable& entry, const std::string& name) {
+        auto store = std::make_unique<MutationStore>(store_directory(name), durability);
+        store->start([this, &entry, name](const std::vector<Mutation>& mutations) { apply_group(entry, name, mutations); });
+        return store;
+    }
+
+    // If `name` has mutations on disk, opens its store and applies them to
+    // `engine`.
+    std::shared_ptr<Mutable> recover(const std::string& name, std::shared_ptr<const QueryEngine>& engine) {
+        auto entry = std::make_shared<Mutable>();
+        if (!std::filesystem::is_directory(store_directory(name))) {
+            return entry;
+        }
+        auto start = std::chrono::steady_clock::now();
+        entry->store = open_store(*entry, name);
+        auto mutations = entry->store->overlay_mutations();
+        if (!mutations.empty()) {
+            engine = apply_mutations(*engine, mutations, segment_options);
+        }
+        MutationStore::Stats stats = entry->store->status();
+        std::cout << "Collection " << name << ": recovered " << stats.recovered << " mutated files (checkpoint at "
+                  << stats.checkpoint_sequence << ", " << stats.replayed << " log records replayed) in "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms\n";
+        return entry;
+    }
+
+    void apply_group(Mutable& entry, const std::string& name, const std::vector<Mutation>& mutations) {
+        std::lock_guard<std::mutex> apply_lock(entry.apply);
+        std::shared_ptr<CollectionSlot> slot;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = mutables.find(name);
+            if (it == mutables.end() || it->second.get() != &entry) {
+                return;  // dropped
+            }
+            slot = slots.at(name);
+        }
+        auto old = slot->load();
+        publish(name, slot, *old, apply_mutations(*old->engine, mutations, segment_options));
+    }
+
+    // Swaps in `engine` as the generation after `old`, unless `name` was
+    // dropped, and queues `name` for the merger, which works out on its own
+    // thread whether the new segments call for a merge. Callers hold the
+    // collection's apply lock.
+    void publish(const std::string& name, const std::shared_ptr<CollectionSlot>& slot, const Collection& old,
+                 std::shared_ptr<const QueryEngine> engine) {
+        auto next = make_collection(name, old.path, old.index, old.metric);
+        next->generation = old.generation + 1;
+        next->source_stamp = old.source_stamp;
+        next->engine = std::move(engine);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = slots.find(name);
+        if (it == slots.end() || it->second != slot) {
+            return;
+        }
+        std::atomic_store(&slot->current, std::shared_ptr<const Collection>(next));
+        bytes = bytes - old.engine->corpus_bytes() + next->engine->corpus_bytes();
+        if (merge_queued.insert(name).second) {
+            merge_queue.push_back(name);
+            merge_cv.notify_one();
+        }
+    }
+
+    void merge_loop() {
+        for (;;) {
+            std::string name;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                merge_cv.wait(lock, [&] { return shutdown || !merge_queue.empty(); });
+                if (shutdown) {
+                    return;
+                }
+                name = merge_queue.front();
+                merge_queue.pop_front();
+                merge_queued.erase(name);
+            }
+            try {
+                merge_now(name);
+            } catch (const std::exception& e) {
+                std::cerr << "Collection " << name << ": merge failed: " << e.what() << "\n";
+            }
+        }
+    }
+
+    // Runs the next merge `name` needs, if any. The merged segment is built
+    // while queries and mutations go on; only the swap takes the apply lock.
+    void merge_now(const std::string& name) {
+        std::shared_ptr<CollectionSlot> slot;
+        std::shared_ptr<Mutable> entry;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = slots.find(name);
+            if (it == slots.end()) {
+                return;
+            }
+            slot = it->second;
+            entry = mutables.at(name);
+        }
+        auto source = slot->load();
+        auto plan = plan_merge(*source->engine, segment_options);
+        if (!plan) {
+            return;
+        }
+        const auto& shards = source->engine->corpus_shards();
+        std::vector<QueryEngine::Shard> sources(shards.begin() + plan->begin, shards.begin() + plan->end);
+        auto start = std::chrono::steady_clock::now();
+        auto merged = merge_segments(sources, source->engine->dim());
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::lock_guard<std::mutex> apply_lock(entry->apply);
+        auto current = slot->load();
+        std::shared_ptr<const QueryEngine> engine = replace_segments(*current->engine, sources, merged);
+        if (!engine) {
+            return;  // reloaded meanwhile
+        }
+        std::cout << "Collection " << name << ": merged " << sources.size() << " segments into " << merged->rows() << " rows in "
+                  << ms << " ms, " << engine->corpus_shards().size() << " segments left\n";
+        publish(name, slot, *current, std::move(engine));
+    }
+
+    // Changes whenever an embedding file under `path` is added, removed,
+    // resized or rewritten.
+    static std::uint64_t directory_stamp(const std::string& path) {
+        std::uint64_t stamp = 0;
+        std::error_code error;
+        for (std::filesystem::recursive_directory_iterator it(path, error), end; !error && it != end; it.increment(error)) {
+            if (it->path().extension() != ".json") {
+                continue;
+            }
+            std::uint64_t size = it->file_size(error);
+            std::uint64_t mtime = it->last_write_time(error).time_since_epoch().count();
+            std::uint64_t entry = std::hash<std::string>()(it->path().string()) ^ (size * 0x9e3779b97f4a7c15ULL) ^ mtime;
+            stamp += entry * 0xbf58476d1ce4e5b9ULL;
+        }
+        return stamp;
+    }
+
+    void reload_loop() {
+        for (;;) {
+            std::string name;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                auto ready = [&] { return shutdown || !reload_queue.empty(); };
+                if (watch_interval.count() > 0) {
+                    cv.wait_for(lock, watch_interval, ready);
+                } else {
+                    cv.wait(lock, ready);
+                }
+                if (shutdown) {
+                    return;
+                }
+                if (reload_queue.empty()) {
+                    queue_changed_collections(lock);
+                    continue;
+                }
+                name = reload_queue.front();
+                reload_queue.pop_front();
+            }
+            reload_now(name);
+        }
+    }
+
+    // Queues every collection whose directory no longer matches its stamp.
+    // The directories are walked without the lock.
+    void queue_changed_collections(std::unique_lock<std::mutex>& lock) {
+        std::vector<std::shared_ptr<const Collection>> current;
+        for (const auto& entry : slots) {
+            current.push_back(entry.second->load());
+        }
+        lock.unlock();
+        std::vector<std::string> changed;
+        for (const auto& collection : current) {
+            if (directory_stamp(collection->path) != collection->source_stamp) {
+                changed.push_back(collection->name);
+            }
+        }
+        lock.lock();
+        for (const auto& name : changed) {
+            ReloadStatus& status = reload_status[name];
+            if (slots.count(name) && status.state != "queued" && status.state != "loading") {
+                std::cout << "Collection " << name << " changed on disk, reloading\n";
+                status.state = "queued";
+                reload_queue.push_back(name);
+            }
+        }
+    }
+
+    void reload_now(const std::string& name) {
+        std::shared_ptr<CollectionSlot> slot;
+        std::shared_ptr<Mutable> entry;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = slots.find(name);
+            if (it == slots.end()) {
+                return;
+            }
+            slot = it->second;
+            entry = mutables.at(name);
+            reload_status[name].state = "loading";
+        }
+        auto old = slot->load();
+
+        auto start = std::chrono::steady_clock::now();
+        auto next = make_collection(name, old->path, old->index, old->metric);
+        std::string error;
+        try {
+            next->source_stamp = directory_stamp(old->path);
+            next->engine = load(old->path);
+        } catch (const std::exception& e) {
+            error = e.what();
+        }
+
+        // Mutations committed meanwhile are in the overlay taken here, and
+        // groups applied meanwhile are replaced along with `old`.
+        std::lock_guard<std::mutex> apply_lock(entry->apply);
+        if (error.empty() && entry->store) {
+            try {
+                auto mutations = entry->store->overlay_mutations();
+                if (!mutations.empty()) {
+                    next->engine = apply_mutations(*next->engine, mutations, segment_options);
+                }
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+        }
+        old = slot->load();
+        next->generation = old->generation + 1;
+        auto loaded = std::chrono::steady_clock::now();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = slots.find(name);
+        if (it == slots.end() || it->second != slot) {
+            return;  // dropped while loading
+        }
+        ReloadStatus& status = reload_status[name];
+        if (error.empty() && max_bytes > 0 &&
+            bytes - old->engine->corpus_bytes() + next->engine->corpus_bytes() > max_bytes) {
+            error = CollectionBudgetExceeded().what();
+        }
+        if (!error.empty()) {
+            status.state = "failed";
+            status.error = error;
+            return;
+        }
+        auto swap_start = std::chrono::steady_clock::now();
+        std::atomic_store(&slot->current, std::shared_ptr<const Collection>(next));
+        auto swapped = std::chrono::steady_clock::now();
+
+        bytes = bytes - old->engine->corpus_bytes() + next->engine->corpus_bytes();
+        status.state = "idle";
+        status.error.clear();
+        status.reloads++;
+        status.load_ms = std::chrono::duration<double, std::milli>(loaded - start).count();
+        status.swap_us = std::chrono::duration<double, std::micro>(swapped - swap_start).count();
+        status.overlap_bytes = old->engine->corpus_bytes() + next->engine->corpus_bytes();
+        status.retired_after_ms = -1;
+        swaps[name] = {old->id, swapped};
+        std::cout << "Collection " << name << " generation " << next->generation << ": " << next->engine->size() << " rows loaded in "
+                  << status.load_ms << " ms, swapped in " << status.swap_us << " us\n";
+    }
+
+    static bool valid_name(const std::string& name) {
+        return !name.empty() && name.size() <= 64 &&
+               std::all_of(name.begin(), name.end(), [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_'; });
+    }
+};
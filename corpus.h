@@ -0,0 +1,91 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <utility>
+
+#include "page_alloc.h"
+
+// Row-major embedding storage owned by the engine. Every row starts on a
+// 64-byte boundary and is padded with zeros up to a multiple of 16 floats,
+// so scan kernels can treat the padded width as the dimension: zero padding
+// leaves dot products, squared distances and L1 distances unchanged as long
+// as the query is padded the same way. Large corpora are placed on huge
+// pages when the system allows it (see page_alloc.h).
+class Corpus {
+private:
+    float* data_ = nullptr;
+    Eigen::Index rows_ = 0;
+    Eigen::Index dim_ = 0;
+    Eigen::Index stride_ = 0;
+    PageAllocation allocation_;
+
+    void release() {
+        free_pages(allocation_);
+        data_ = nullptr;
+    }
+
+public:
+    static constexpr std::size_t kAlignment = 64;
+    static constexpr Eigen::Index kRowPadding = 16;
+
+    using MatrixView = Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>, Eigen::Aligned64>;
+
+    Corpus() = default;
+
+    Corpus(Eigen::Index rows, Eigen::Index dim)
+        : rows_(rows), dim_(dim), stride_(padded_dim(dim)),
+          allocation_(allocate_pages(static_cast<std::size_t>(rows * stride_) * sizeof(float), kAlignment)) {
+        data_ = static_cast<float*>(allocation_.data);
+    }
+
+    Corpus(const Corpus&) = delete;
+    Corpus& operator=(const Corpus&) = delete;
+
+    Corpus(Corpus&& other) noexcept { *this = std::move(other); }
+
+    Corpus& operator=(Corpus&& other) noexcept {
+        if (this != &other) {
+            release();
+            data_ = std::exchange(other.data_, nullptr);
+            rows_ = std::exchange(other.rows_, 0);
+            dim_ = std::exchange(other.dim_, 0);
+            stride_ = std::exchange(other.stride_, 0);
+            allocation_ = std::exchange(other.allocation_, PageAllocation{});
+        }
+        return *this;
+    }
+
+    ~Corpus() { release(); }
+
+    static Eigen::Index padded_dim(Eigen::Index dim) {
+        return (dim + kRowPadding - 1) / kRowPadding * kRowPadding;
+    }
+
+    Eigen::Index rows() const { return rows_; }
+    Eigen::Index dim() const { return dim_; }
+    Eigen::Index stride() const { return stride_; }
+    std::size_t bytes() const { return allocation_.bytes; }
+    PageBacking backing() const { return allocation_.backing; }
+    std::size_t huge_page_bytes() const { return ::huge_page_bytes(allocation_); }
+
+    float* row(Eigen::Index i) { return data_ + i * stride_; }
+    const float* row(Eigen::Index i) const { return data_ + i * stride_; }
+    const float* data() const { return data_; }
+
+    // Drops trailing rows, e.g. files the loader had to skip. Storage is kept.
+    void truncate(Eigen::Index rows) {
+        if (rows < rows_) {
+            rows_ = rows;
+        }
+    }
+
+    // The whole padded matrix, rows x stride.
+    MatrixView matrix() const { return MatrixView(data_, rows_, stride_); }
+
+    // Zero-pads a query of the logical dimension to the row stride.
+    Eigen::VectorXf pad_query(const Eigen::VectorXf& query) const {
+        Eigen::VectorXf padded = Eigen::VectorXf::Zero(stride_);
+        padded.head(query.size()) = query;
+        return padded;
+    }
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "corpus.h"
+#include "metric.h"
+#include "query_engine.h"
+#include "self_join.h"
+
+// `myserver dedup --min_score 0.95 --output duplicates.tsv --threads T --block_rows B`
+// Finds every pair of images whose embeddings have cosine similarity of at
+// least min_score with a tiled self-join of the corpus (see self_join.h),
+// instead of one /query per image. Pairs are written as
+//   path_a <TAB> path_b <TAB> similarity
+// in no particular order, one tile at a time, so memory is bounded by the
+// corpus plus one tile per thread.
+inline int run_dedup(const std::string& embedding_dir, float min_score, const std::string& output, int threads,
+                     Eigen::Index block_rows) {
+    auto start = std::chrono::steady_clock::now();
+    auto [corpus, image_paths] = load_embeddings(embedding_dir);
+    RowStats stats = RowStats::compute(corpus);
+    std::cout << "dedup rows=" << corpus.rows() << " dim=" << corpus.dim() << " min_score=" << min_score
+              << " threads=" << threads << " block_rows=" << block_rows << "\n";
+
+    std::ofstream file(output, std::ios::trunc);
+    if (!file) {
+        std::cerr << "Could not open " << output << "\n";
+        return 1;
+    }
+    std::mutex file_mutex;
+    std::atomic<std::uint64_t> pairs{0};
+
+    for_each_self_join_tile(corpus, block_rows, threads, [&](Eigen::Index i_begin, Eigen::Index j_begin, const SelfJoinTile& tile) {
+        std::string lines;
+        std::uint64_t found = 0;
+        for (Eigen::Index a = 0; a < tile.rows(); ++a) {
+            Eigen::Index i = i_begin + a;
+            float inv_i = stats.inv_norms(i);
+            for (Eigen::Index b = i_begin == j_begin ? a + 1 : 0; b < tile.cols(); ++b) {
+                Eigen::Index j = j_begin + b;
+                float similarity = tile(a, b) * inv_i * stats.inv_norms(j);
+                if (similarity < min_score) {
+                    continue;
+                }
+                char score[32];
+                auto result = std::to_chars(score, score + sizeof(score), similarity);
+                lines.append(image_paths[i]).append("\t").append(image_paths[j]).append("\t").append(score, result.ptr).append("\n");
+                found++;
+            }
+        }
+        if (found > 0) {
+            std::lock_guard<std::mutex> lock(file_mutex);
+            file << lines;
+        }
+        pairs += found;
+    });
+
+    file.close();
+    if (!file) {
+        std::cerr << "Could not write " << output << "\n";
+        return 1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << pairs.load() << " pairs written to " << output << " in " << seconds << " s\n";
+    return 0;
+}
@@ -0,0 +1,703 @@
+#pragma once
+
+#ifdef __linux__
+
+#include "httplib.h"
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "admission.h"
+#include "file_cache.h"
+
+// Event-driven HTTP/1.1 front end, an alternative to httplib::Server::listen.
+// httplib parks a pool thread on every keep-alive connection, so at most
+// --threads clients are served at once and idle sockets hold threads. Here a
+// few I/O threads, each with its own epoll set, accept, read and write every
+// connection without blocking; only a fully received request is handed to
+// the worker pool, which runs the route handler and serializes the response.
+// Handlers are registered with the same signatures and patterns as on
+// httplib::Server (httplib's matchers are reused), so routes behave the
+// same on both front ends. Requests are answered in order per connection;
+// pipelined requests wait in the input buffer until the previous one is done.
+// Bodies from a FileContentProvider are sent with sendfile() instead of being
+// copied into the output buffer.
+class EpollServer {
+public:
+    using Handler = httplib::Server::Handler;
+
+    static constexpr std::size_t kMaxHeaderBytes = 8192;
+    static constexpr std::size_t kMaxBodyBytes = 64 << 20;
+    static constexpr std::chrono::seconds kKeepAliveTimeout{CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND};
+
+    // `workers` handler threads with at most `max_queued` requests waiting;
+    // beyond that the overload handler answers on the I/O thread.
+    EpollServer(std::size_t io_threads, std::size_t workers, std::size_t max_queued)
+        : pool(std::make_unique<httplib::ThreadPool>(workers, max_queued)) {
+        for (std::size_t i = 0; i < std::max<std::size_t>(1, io_threads); ++i) {
+            auto loop = std::make_unique<Loop>();
+            loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            watch(*loop, loop->wake_fd, kWakeToken, EPOLLIN, EPOLL_CTL_ADD);
+            loops.push_back(std::move(loop));
+        }
+    }
+
+    EpollServer(const EpollServer&) = delete;
+    EpollServer& operator=(const EpollServer&) = delete;
+
+    ~EpollServer() {
+        stop();
+        if (pool) {
+            pool->shutdown();
+        }
+        for (auto& loop : loops) {
+            close(loop->epoll_fd);
+            close(loop->wake_fd);
+        }
+        if (listen_fd >= 0) {
+            close(listen_fd);
+        }
+    }
+
+    EpollServer& Get(const std::string& pattern, Handler handler) { return add_route("GET", pattern, std::move(handler)); }
+    EpollServer& Post(const std::string& pattern, Handler handler) { return add_route("POST", pattern, std::move(handler)); }
+    EpollServer& Put(const std::string& pattern, Handler handler) { return add_route("PUT", pattern, std::move(handler)); }
+    EpollServer& Delete(const std::string& pattern, Handler handler) { return add_route("DELETE", pattern, std::move(handler)); }
+    EpollServer& Options(const std::string& pattern, Handler handler) { return add_route("OPTIONS", pattern, std::move(handler)); }
+
+    // Builds the response sent when the worker queue is full. The connection
+    // is closed afterwards, like the httplib path's rejecter.
+    void set_overload_handler(Handler handler) { overload_handler = std::move(handler); }
+
+    bool bind_to_port(const std::string& host, int port) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* result = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0) {
+            return false;
+        }
+        for (addrinfo* ai = result; ai && listen_fd < 0; ai = ai->ai_next) {
+            int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            int yes = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, SOMAXCONN) == 0) {
+                listen_fd = fd;
+            } else {
+                close(fd);
+            }
+        }
+        freeaddrinfo(result);
+        return listen_fd >= 0;
+    }
+
+    int bind_to_any_port(const std::string& host) {
+        if (!bind_to_port(host, 0)) {
+            return -1;
+        }
+        sockaddr_storage addr{};
+        socklen_t len = sizeof(addr);
+        getsockname(listen_fd, reinterpret_cast<sockaddr*>(&addr), &len);
+        return ntohs(addr.ss_family == AF_INET6 ? reinterpret_cast<sockaddr_in6*>(&addr)->sin6_port
+                                                : reinterpret_cast<sockaddr_in*>(&addr)->sin_port);
+    }
+
+    // Runs the I/O threads until stop(); waits for in-flight handlers.
+    bool listen_after_bind() {
+        if (listen_fd < 0) {
+            return false;
+        }
+        std::vector<std::thread> threads;
+        for (auto& loop : loops) {
+            watch(*loop, listen_fd, kListenToken, EPOLLIN | EPOLLEXCLUSIVE, EPOLL_CTL_ADD);
+            threads.emplace_back([this, &loop = *loop] { run_loop(loop); });
+        }
+        running = true;
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        running = false;
+        pool->shutdown();
+        pool.reset();
+        return true;
+    }
+
+    bool listen(const std::string& host, int port) { return bind_to_port(host, port) && listen_after_bind(); }
+
+    bool is_running() const { return running; }
+
+    void stop() {
+        stopping = true;
+        for (auto& loop : loops) {
+            loop->wake();
+        }
+    }
+
+private:
+    static constexpr std::uint64_t kListenToken = 0;
+    static constexpr std::uint64_t kWakeToken = 1;
+
+    struct Route {
+        std::string method;
+        std::unique_ptr<httplib::detail::MatcherBase> matcher;
+        Handler handler;
+    };
+
+    // A serialized response: header bytes (and any in-memory body), then an
+    // optional range of an open file.
+    struct Output {
+        std::string bytes;
+        std::shared_ptr<const OpenFile> file;
+        off_t file_offset = 0;
+        std::size_t file_end = 0;
+    };
+
+    struct Connection {
+        int fd = -1;
+        std::string remote_addr;
+        int remote_port = -1;
+        std::string in;
+        std::deque<Output> out;
+        std::size_t out_offset = 0;
+        bool busy = false;
+        bool continue_sent = false;
+        bool close_after_write = false;
+        bool want_write = false;
+        std::chrono::steady_clock::time_point last_active;
+    };
+
+    // A response produced by a worker for connection `id`.
+    struct Completion {
+        std::uint64_t id;
+        Output response;
+        bool close;
+    };
+
+    // One I/O thread's state. Connections are only touched by that thread;
+    // workers hand results back through `completions` and the eventfd.
+    struct Loop {
+        int epoll_fd = -1;
+        int wake_fd = -1;
+        std::unordered_map<std::uint64_t, Connection> connections;
+        std::mutex mutex;
+        std::vector<Completion> completions;
+
+        void wake() {
+            std::uint64_t one = 1;
+            ssize_t written = write(wake_fd, &one, sizeof(one));
+            (void)written;
+        }
+    };
+
+    std::vector<Route> routes;
+    Handler overload_handler;
+    std::vector<std::unique_ptr<Loop>> loops;
+    std::unique_ptr<httplib::ThreadPool> pool;
+    int listen_fd = -1;
+    std::atomic<bool> running{false};
+    std::atomic<bool> stopping{false};
+    std::atomic<std::uint64_t> next_id{2};
+
+    EpollServer& add_route(const std::string& method, const std::string& pattern, Handler handler) {
+        // Same rule as httplib::Server::make_matcher.
+        std::unique_ptr<httplib::detail::MatcherBase> matcher;
+        if (pattern.find("/:") != std::string::npos) {
+            matcher = std::make_unique<httplib::detail::PathParamsMatcher>(pattern);
+        } else {
+            matcher = std::make_unique<httplib::detail::RegexMatcher>(pattern);
+        }
+        routes.push_back({method, std::move(matcher), std::move(handler)});
+        return *this;
+    }
+
+    static void watch(Loop& loop, int fd, std::uint64_t token, std::uint32_t events, int op) {
+        epoll_event event{};
+        event.events = events;
+        event.data.u64 = token;
+        epoll_ctl(loop.epoll_fd, op, fd, &event);
+    }
+
+    void run_loop(Loop& loop) {
+        constexpr int kMaxEvents = 256;
+        epoll_event events[kMaxEvents];
+        auto last_sweep = std::chrono::steady_clock::now();
+        while (!stopping) {
+            int n = epoll_wait(loop.epoll_fd, events, kMaxEvents, 1000);
+            if (n < 0 && errno != EINTR) {
+                break;
+            }
+            for (int i = 0; i < n; ++i) {
+                std::uint64_t token = events[i].data.u64;
+                if (token == kListenToken) {
+                    accept_all(loop);
+                } else if (token == kWakeToken) {
+                    std::uint64_t count;
+                    ssize_t drained = read(loop.wake_fd, &count, sizeof(count));
+                    (void)drained;
+                    complete_all(loop);
+                } else {
+                    handle_event(loop, token, events[i].events);
+                }
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_sweep >= std::chrono::seconds(1)) {
+                close_idle(loop, now);
+                last_sweep = now;
+            }
+        }
+
+        epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, listen_fd, nullptr);
+        for (auto& [id, connection] : loop.connections) {
+            close(connection.fd);
+        }
+        loop.connections.clear();
+    }
+
+    void accept_all(Loop& loop) {
+        for (;;) {
+            sockaddr_storage addr{};
+            socklen_t len = sizeof(addr);
+            int fd = accept4(listen_fd, reinterpret_cast<sockaddr*>(&addr), &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            int yes = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+            std::uint64_t id = next_id++;
+            Connection& connection = loop.connections[id];
+            connection.fd = fd;
+            connection.last_active = std::chrono::steady_clock::now();
+            char host[INET6_ADDRSTRLEN] = "";
+            if (addr.ss_family == AF_INET) {
+                auto* in = reinterpret_cast<sockaddr_in*>(&addr);
+                inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+                connection.remote_port = ntohs(in->sin_port);
+            } else if (addr.ss_family == AF_INET6) {
+                auto* in6 = reinterpret_cast<sockaddr_in6*>(&addr);
+                inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+                connection.remote_port = ntohs(in6->sin6_port);
+            }
+            connection.remote_addr = host;
+            watch(loop, fd, id, EPOLLIN, EPOLL_CTL_ADD);
+        }
+    }
+
+    void handle_event(Loop& loop, std::uint64_t id, std::uint32_t events) {
+        auto it = loop.connections.find(id);
+        if (it == loop.connections.end()) {
+            return;
+        }
+        Connection& connection = it->second;
+        if (events & EPOLLIN) {
+            if (!read_available(loop, id, connection)) {
+                return;
+            }
+        } else if (events & (EPOLLHUP | EPOLLERR)) {
+            close_connection(loop, id);
+            return;
+        }
+        if ((events & EPOLLOUT) && !flush(loop, id, connection)) {
+            return;
+        }
+        process_input(loop, id, connection);
+    }
+
+    // Returns false if the connection was closed.
+    bool read_available(Loop& loop, std::uint64_t id, Connection& connection) {
+        char buffer[65536];
+        for (;;) {
+            ssize_t n = recv(connection.fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                connection.in.append(buffer, n);
+                connection.last_active = std::chrono::steady_clock::now();
+                if (connection.in.size() > kMaxHeaderBytes + kMaxBodyBytes) {
+                    close_connection(loop, id);
+                    return false;
+                }
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return true;
+            }
+            // Peer closed or reset; a response still being computed is dropped.
+            close_connection(loop, id);
+            return false;
+        }
+    }
+
+    // Writes as much of the queued output as the socket takes. Returns false
+    // if the connection was closed.
+    bool flush(Loop& loop, std::uint64_t id, Connection& connection) {
+        while (!connection.out.empty()) {
+            Output& output = connection.out.front();
+            ssize_t n;
+            if (connection.out_offset < output.bytes.size()) {
+                n = send(connection.fd, output.bytes.data() + connection.out_offset,
+                         output.bytes.size() - connection.out_offset, MSG_NOSIGNAL);
+                if (n > 0) {
+                    connection.out_offset += n;
+                }
+            } else if (output.file && static_cast<std::size_t>(output.file_offset) < output.file_end) {
+                n = sendfile(connection.fd, output.file->fd, &output.file_offset, output.file_end - output.file_offset);
+            } else {
+                connection.out.pop_front();
+                connection.out_offset = 0;
+                continue;
+            }
+            if (n > 0) {
+                continue;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                close_connection(loop, id);
+                return false;
+            }
+        }
+
+        bool drained = connection.out.empty();
+        if (drained) {
+            connection.last_active = std::chrono::steady_clock::now();
+            if (connection.close_after_write) {
+                close_connection(loop, id);
+                return false;
+            }
+        }
+        if (drained == connection.want_write) {
+            connection.want_write = !drained;
+            watch(loop, connection.fd, id, drained ? EPOLLIN : EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+        }
+        return true;
+    }
+
+    void close_connection(Loop& loop, std::uint64_t id) {
+        auto it = loop.connections.find(id);
+        if (it == loop.connections.end()) {
+            return;
+        }
+        epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+        close(it->second.fd);
+        loop.connections.erase(it);
+    }
+
+    void close_idle(Loop& loop, std::chrono::steady_clock::time_point now) {
+        std::vector<std::uint64_t> idle;
+        for (const auto& [id, connection] : loop.connections) {
+            if (!connection.busy && connection.out.empty() && now - connection.last_active > kKeepAliveTimeout) {
+                idle.push_back(id);
+            }
+        }
+        for (std::uint64_t id : idle) {
+            close_connection(loop, id);
+        }
+    }
+
+    void complete_all(Loop& loop) {
+        std::vector<Completion> completions;
+        {
+            std::lock_guard<std::mutex> lock(loop.mutex);
+            completions.swap(loop.completions);
+        }
+        for (auto& completion : completions) {
+            auto it = loop.connections.find(completion.id);
+            if (it == loop.connections.end()) {
+                continue;
+            }
+            Connection& connection = it->second;
+            connection.busy = false;
+            connection.close_after_write = completion.close;
+            connection.out.push_back(std::move(completion.response));
+            if (flush(loop, completion.id, connection)) {
+                process_input(loop, completion.id, connection);
+            }
+        }
+    }
+
+    // Parses the next complete request in the input buffer, if any, and
+    // dispatches it to a worker.
+    void process_input(Loop& loop, std::uint64_t id, Connection& connection) {
+        if (connection.busy || connection.close_after_write) {
+            return;
+        }
+        std::size_t header_end = connection.in.find("\r\n\r\n");
+        if (header_end == std::string::npos) {
+            if (connection.in.size() > kMaxHeaderBytes) {
+                reply_error(loop, id, connection, 431);
+            }
+            return;
+        }
+        if (header_end > kMaxHeaderBytes) {
+            reply_error(loop, id, connection, 431);
+            return;
+        }
+
+        auto req = std::make_shared<httplib::Request>();
+        if (!parse_head(connection.in.substr(0, header_end), *req)) {
+            reply_error(loop, id, connection, 400);
+            return;
+        }
+        if (req->has_header("Transfer-Encoding")) {
+            reply_error(loop, id, connection, 501);
+            return;
+        }
+        if (req->has_header("Range") && !httplib::detail::parse_range_header(req->get_header_value("Range"), req->ranges)) {
+            reply_error(loop, id, connection, 416);
+            return;
+        }
+        std::uint64_t content_length = req->get_header_value_u64("Content-Length");
+        if (content_length > kMaxBodyBytes) {
+            reply_error(loop, id, connection, 413);
+            return;
+        }
+        std::size_t request_end = header_end + 4 + content_length;
+        if (connection.in.size() < request_end) {
+            if (!connection.continue_sent && req->get_header_value("Expect") == "100-continue") {
+                connection.continue_sent = true;
+                Output interim;
+                interim.bytes = "HTTP/1.1 100 Continue\r\n\r\n";
+                connection.out.push_back(std::move(interim));
+                flush(loop, id, connection);
+            }
+            return;
+        }
+        req->body = connection.in.substr(header_end + 4, content_length);
+        connection.in.erase(0, request_end);
+        connection.continue_sent = false;
+        req->remote_addr = connection.remote_addr;
+        req->remote_port = connection.remote_port;
+        req->is_connection_closed = [] { return false; };
+
+        std::string connection_header = req->get_header_value("Connection");
+        bool keep_alive = req->version == "HTTP/1.1" ? connection_header != "close" : connection_header == "keep-alive";
+
+        connection.busy = true;
+        Loop* owner = &loop;
+        bool queued = pool->enqueue([this, owner, id, req, keep_alive] {
+            httplib::Response res;
+            dispatch(*req, res);
+            bool close = !keep_alive || res.get_header_value("Connection") == "close";
+            Output response = serialize(*req, res, close);
+            {
+                std::lock_guard<std::mutex> lock(owner->mutex);
+                owner->completions.push_back({id, std::move(response), close});
+            }
+            owner->wake();
+        });
+        if (!queued) {
+            AdmissionTaskQueue::rejected_count()++;
+            httplib::Response res;
+            if (overload_handler) {
+                overload_handler(*req, res);
+            } else {
+                res.status = 503;
+            }
+            connection.busy = false;
+            connection.close_after_write = true;
+            connection.out.push_back(serialize(*req, res, true));
+            flush(loop, id, connection);
+        }
+    }
+
+    void reply_error(Loop& loop, std::uint64_t id, Connection& connection, int status) {
+        httplib::Request req;
+        httplib::Response res;
+        res.status = status;
+        connection.close_after_write = true;
+        connection.out.push_back(serialize(req, res, true));
+        flush(loop, id, connection);
+    }
+
+    // Request line and headers, without the terminating blank line.
+    static bool parse_head(const std::string& head, httplib::Request& req) {
+        std::size_t line_end = head.find("\r\n");
+        std::string request_line = head.substr(0, line_end);
+        std::size_t first_space = request_line.find(' ');
+        std::size_t second_space = request_line.find(' ', first_space + 1);
+        if (first_space == std::string::npos || second_space == std::string::npos) {
+            return false;
+        }
+        req.method = request_line.substr(0, first_space);
+        req.target = request_line.substr(first_space + 1, second_space - first_space - 1);
+        req.version = request_line.substr(second_space + 1);
+        if (req.version != "HTTP/1.1" && req.version != "HTTP/1.0") {
+            return false;
+        }
+
+        std::size_t query_start = req.target.find('?');
+        req.path = httplib::detail::decode_url(req.target.substr(0, query_start), false);
+        if (query_start != std::string::npos) {
+            httplib::detail::parse_query_text(req.target.substr(query_start + 1), req.params);
+        }
+
+        while (line_end != std::string::npos) {
+            std::size_t start = line_end + 2;
+            line_end = head.find("\r\n", start);
+            std::string line = head.substr(start, line_end == std::string::npos ? std::string::npos : line_end - start);
+            std::size_t colon = line.find(':');
+            if (colon == std::string::npos || colon == 0) {
+                return false;
+            }
+            std::size_t value_start = line.find_first_not_of(" \t", colon + 1);
+            std::size_t value_end = line.find_last_not_of(" \t");
+            std::string value = value_start == std::string::npos ? "" : line.substr(value_start, value_end - value_start + 1);
+            req.headers.emplace(line.substr(0, colon), value);
+        }
+        return true;
+    }
+
+    // Runs the matching route like httplib::Server::process_request: HEAD is
+    // served by the GET handlers, unmatched requests get 404, and a handler
+    // that leaves the status unset answers 200, or 206 for a Range request.
+    void dispatch(httplib::Request& req, httplib::Response& res) const {
+        const std::string& method = req.method == "HEAD" ? std::string("GET") : req.method;
+        for (const auto& route : routes) {
+            if (route.method != method || !route.matcher->match(req)) {
+                continue;
+            }
+            try {
+                route.handler(req, res);
+            } catch (const std::exception& e) {
+                res.status = 500;
+                res.set_header("EXCEPTION_WHAT", e.what());
+            }
+            if (res.status == -1) {
+                res.status = req.ranges.empty() ? 200 : 206;
+            }
+            if (httplib::detail::range_error(req, res)) {
+                res.body.clear();
+                res.content_length_ = 0;
+                res.content_provider_ = nullptr;
+                res.status = 416;
+            }
+            return;
+        }
+        res.status = 404;
+    }
+
+    // Drains a content provider into res.body; responses are written from a
+    // single buffer.
+    static bool materialize(httplib::Response& res) {
+        if (!res.content_provider_) {
+            return true;
+        }
+        res.body.clear();
+        bool done = false;
+        httplib::DataSink sink;
+        sink.write = [&](const char* data, std::size_t size) {
+            res.body.append(data, size);
+            return true;
+        };
+        sink.is_writable = [] { return true; };
+        sink.done = [&] { done = true; };
+        sink.done_with_trailer = [&](const httplib::Headers&) { done = true; };
+
+        std::size_t length = res.content_length_;
+        while (length > 0 ? res.body.size() < length : !done) {
+            std::size_t offset = res.body.size();
+            if (!res.content_provider_(offset, length > 0 ? length - offset : 0, sink)) {
+                return false;
+            }
+        }
+        res.content_provider_success_ = true;
+        return true;
+    }
+
+    // Status line and headers, then the body or, for a single Range on a 206,
+    // the selected slice of it. Multiple ranges become multipart/byteranges
+    // as in httplib. File bodies are left to sendfile().
+    static Output serialize(const httplib::Request& req, httplib::Response& res, bool close) {
+        Output output;
+        std::size_t content_length = res.content_provider_ ? res.content_length_ : res.body.size();
+        auto* file_provider = res.content_provider_.target<FileContentProvider>();
+        bool ranged = res.status == 206 && !req.ranges.empty();
+        if (file_provider && (!ranged || req.ranges.size() == 1)) {
+            output.file = file_provider->file;
+            output.file_offset = file_provider->base;
+            output.file_end = file_provider->base + content_length;
+        } else if (!materialize(res)) {
+            res.status = 500;
+            res.body.clear();
+            ranged = false;
+        }
+
+        if (ranged && req.ranges.size() == 1) {
+            auto offset_and_length = httplib::detail::get_range_offset_and_length(req.ranges[0], content_length);
+            res.set_header("Content-Range", httplib::detail::make_content_range_header_field(offset_and_length, content_length));
+            if (output.file) {
+                output.file_offset += offset_and_length.first;
+                output.file_end = output.file_offset + offset_and_length.second;
+            } else {
+                res.body = res.body.substr(offset_and_length.first, offset_and_length.second);
+            }
+        } else if (ranged) {
+            std::string content_type = res.get_header_value("Content-Type");
+            res.headers.erase("Content-Type");
+            std::string boundary = httplib::detail::make_multipart_data_boundary();
+            std::string data;
+            httplib::detail::make_multipart_ranges_data(req, res, boundary, content_type, res.body.size(), data);
+            res.body = std::move(data);
+            res.set_header("Content-Type", "multipart/byteranges; boundary=" + boundary);
+        }
+        bool has_body = res.status >= 200 && res.status != 204 && res.status != 304;
+        std::size_t body_length = output.file ? output.file_end - output.file_offset : res.body.size();
+
+        std::string& out = output.bytes;
+        out = "HTTP/1.1 " + std::to_string(res.status) + " " +
+              (res.reason.empty() ? httplib::status_message(res.status) : res.reason) + "\r\n";
+        for (const auto& [name, value] : res.headers) {
+            if (httplib::detail::case_ignore::equal(name, "Content-Length") ||
+                httplib::detail::case_ignore::equal(name, "Connection")) {
+                continue;
+            }
+            out += name + ": " + value + "\r\n";
+        }
+        out += close ? "Connection: close\r\n" : "Connection: keep-alive\r\n";
+        if (has_body) {
+            out += "Content-Length: " + std::to_string(body_length) + "\r\n";
+        }
+        out += "\r\n";
+        if (!has_body || req.method == "HEAD") {
+            output.file = nullptr;
+        } else if (!output.file) {
+            out += res.body;
+        }
+        return output;
+    }
+};
+
+#endif  // __linux__
@@ -0,0 +1,201 @@
+#pragma once
+
+#include "httplib.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+// A read-only file held open and mapped, with the validators HTTP caching
+// needs. Shared by the cache and by every response still sending it, so an
+// evicted or replaced file stays valid until the last send finishes.
+struct OpenFile {
+    int fd = -1;
+    std::size_t size = 0;
+    const char* data = nullptr;
+    dev_t device = 0;
+    ino_t inode = 0;
+    timespec mtime{};
+    std::string etag;
+    std::string last_modified;
+
+    OpenFile() = default;
+    OpenFile(const OpenFile&) = delete;
+    OpenFile& operator=(const OpenFile&) = delete;
+
+    ~OpenFile() {
+        if (data) {
+            munmap(const_cast<char*>(data), size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool same_file(const struct stat& st) const {
+        return st.st_dev == device && st.st_ino == inode && static_cast<std::size_t>(st.st_size) == size &&
+               st.st_mtim.tv_sec == mtime.tv_sec && st.st_mtim.tv_nsec == mtime.tv_nsec;
+    }
+
+    // Conditional GET: If-None-Match takes precedence over If-Modified-Since.
+    static bool not_modified(const std::string& etag, time_t mtime, const std::string& if_none_match,
+                             const std::string& if_modified_since) {
+        if (!if_none_match.empty()) {
+            if (if_none_match == "*") {
+                return true;
+            }
+            std::size_t start = 0;
+            while (start < if_none_match.size()) {
+                std::size_t end = if_none_match.find(',', start);
+                std::string tag = if_none_match.substr(start, end == std::string::npos ? std::string::npos : end - start);
+                tag.erase(0, tag.find_first_not_of(" \t"));
+                tag.erase(tag.find_last_not_of(" \t") + 1);
+                if (tag.rfind("W/", 0) == 0) {
+                    tag.erase(0, 2);
+                }
+                if (tag == etag) {
+                    return true;
+                }
+                if (end == std::string::npos) {
+                    break;
+                }
+                start = end + 1;
+            }
+            return false;
+        }
+        if (!if_modified_since.empty()) {
+            std::tm tm{};
+            if (strptime(if_modified_since.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm)) {
+                return mtime <= timegm(&tm);
+            }
+        }
+        return false;
+    }
+
+    static std::shared_ptr<const OpenFile> open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+        auto file = std::make_shared<OpenFile>();
+        file->fd = fd;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            return nullptr;
+        }
+        file->size = st.st_size;
+        file->device = st.st_dev;
+        file->inode = st.st_ino;
+        file->mtime = st.st_mtim;
+        if (file->size > 0) {
+            void* data = mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                return nullptr;
+            }
+            file->data = static_cast<const char*>(data);
+        }
+
+        char etag[64];
+        snprintf(etag, sizeof(etag), "\"%llx-%zx-%llx\"", static_cast<unsigned long long>(st.st_ino), file->size,
+                 static_cast<unsigned long long>(st.st_mtim.tv_sec) * 1000000000ULL + st.st_mtim.tv_nsec);
+        file->etag = etag;
+        char date[64];
+        std::tm tm{};
+        gmtime_r(&st.st_mtim.tv_sec, &tm);
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        file->last_modified = date;
+        return file;
+    }
+};
+
+// Content provider that streams an OpenFile, or the part of it starting at
+// `base`, straight from its mapping into the socket with no intermediate
+// buffer. The epoll front end recognizes it and uses sendfile() instead.
+struct FileContentProvider {
+    std::shared_ptr<const OpenFile> file;
+    std::size_t base = 0;
+
+    bool operator()(std::size_t offset, std::size_t length, httplib::DataSink& sink) const {
+        return sink.write(file->data + base + offset, length);
+    }
+};
+
+// LRU of open files keyed by path, so hot images skip open/fstat/mmap. Every
+// lookup stat()s the path and reopens it if the file was replaced or
+// modified, so the cache never serves stale bytes.
+class OpenFileCache {
+public:
+    struct Stats {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t entries = 0;
+    };
+
+    explicit OpenFileCache(std::size_t capacity) : capacity(capacity) {}
+
+    // Returns nullptr if the path is missing or not a regular file.
+    std::shared_ptr<const OpenFile> open(const std::string& path) {
+        struct stat st;
+        bool exists = stat(path.c_str(), &st) == 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(path);
+            if (it != index.end()) {
+                if (exists && it->second->second->same_file(st)) {
+                    lru.splice(lru.begin(), lru, it->second);
+                    stats_.hits++;
+                    return it->second->second;
+                }
+                lru.erase(it->second);
+                index.erase(it);
+            }
+            stats_.misses++;
+        }
+        if (!exists) {
+            return nullptr;
+        }
+
+        auto file = OpenFile::open(path);
+        if (!file || capacity == 0) {
+            return file;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(path);
+        if (it != index.end()) {
+            lru.erase(it->second);
+            index.erase(it);
+        }
+        lru.emplace_front(path, file);
+        index.emplace(path, lru.begin());
+        while (lru.size() > capacity) {
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+        return file;
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats stats = stats_;
+        stats.entries = lru.size();
+        return stats;
+    }
+
+private:
+    using Entry = std::pair<std::string, std::shared_ptr<const OpenFile>>;
+
+    std::size_t capacity;
+    mutable std::mutex mutex;
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    Stats stats_;
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+// Appends JSON text directly to a string. Used for responses with a fixed
+// shape that can grow large, e.g. /query with a topk in the thousands, where
+// building an nlohmann::json DOM and dumping it costs more than the scan.
+// The caller writes the punctuation; the writer handles escaping and numbers.
+class JsonWriter {
+public:
+    explicit JsonWriter(std::string& out) : out(out) {}
+
+    JsonWriter& raw(std::string_view text) {
+        out.append(text);
+        return *this;
+    }
+
+    // Escapes quotes, backslashes and control characters; all other bytes,
+    // including UTF-8 sequences, are copied in runs.
+    JsonWriter& string(std::string_view value) {
+        out.push_back('"');
+        std::size_t run = 0;
+        for (std::size_t i = 0; i < value.size(); ++i) {
+            unsigned char c = value[i];
+            if (c >= 0x20 && c != '"' && c != '\\') {
+                continue;
+            }
+            out.append(value.data() + run, i - run);
+            run = i + 1;
+            switch (c) {
+                case '"': out.append("\\\""); break;
+                case '\\': out.append("\\\\"); break;
+                case '\b': out.append("\\b"); break;
+                case '\f': out.append("\\f"); break;
+                case '\n': out.append("\\n"); break;
+                case '\r': out.append("\\r"); break;
+                case '\t': out.append("\\t"); break;
+                default: {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out.append(escaped);
+                }
+            }
+        }
+        out.append(value.data() + run, value.size() - run);
+        out.push_back('"');
+        return *this;
+    }
+
+    // Shortest text that reads back as the same float. JSON has no NaN or
+    // infinity, so those are written as null, as nlohmann::json does.
+    JsonWriter& number(float value) {
+        if (!std::isfinite(value)) {
+            return raw("null");
+        }
+        char text[32];
+        auto result = std::to_chars(text, text + sizeof(text), value);
+        out.append(text, result.ptr);
+        return *this;
+    }
+
+    JsonWriter& integer(long long value) {
+        char text[24];
+        auto result = std::to_chars(text, text + sizeof(text), value);
+        out.append(text, result.ptr);
+        return *this;
+    }
+
+private:
+    std::string& out;
+};
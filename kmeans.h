@@ -0,0 +1,208 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "parallel_for.h"
+#include "query_engine.h"
+
+struct KMeansOptions {
+    int k = 8;
+    int max_iterations = 50;
+    bool spherical = true;  // cluster rows scaled to unit length (cosine)
+    unsigned seed = 42;
+    int threads = 1;
+};
+
+struct KMeansResult {
+    Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> centroids;  // k x dim
+    std::vector<int> assignments;                                                     // per global row
+    std::vector<std::size_t> sizes;
+    double inertia = 0;  // sum of squared distances to the assigned centroid
+    int iterations = 0;
+    bool converged = false;
+};
+
+struct KMeansCancelled : std::runtime_error {
+    KMeansCancelled() : std::runtime_error("Clustering cancelled") {}
+};
+
+// Called after every iteration with the iteration number and the rows that
+// changed cluster; returning false cancels the run with KMeansCancelled.
+using KMeansProgress = std::function<bool(int, std::size_t)>;
+
+// Lloyd's k-means over every row of the engine's corpus, seeded with
+// k-means++. The assignment step keeps Hamerly's bounds per row (an upper
+// bound on the distance to its own centroid and a lower bound on the
+// distance to any other) and skips every row the triangle inequality proves
+// unchanged; the rest are scored against all centroids with one GEMV, in
+// the same ||x||^2 - 2 x.c + ||c||^2 form as EuclideanMetric. Rows are
+// split over `threads` threads.
+inline KMeansResult kmeans(const QueryEngine& engine, const KMeansOptions& options, const KMeansProgress& progress) {
+    using RowMatrix = Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+    const Eigen::Index rows = engine.size();
+    const Eigen::Index stride = engine.stride();
+    const int k = options.k;
+    if (k < 1 || k > rows) {
+        throw std::invalid_argument("k must be between 1 and the number of rows");
+    }
+    constexpr float kInfinity = std::numeric_limits<float>::infinity();
+
+    // Row i as clustered: w * x, with w = 1/||x|| for spherical k-means.
+    struct Point {
+        Eigen::Map<const Eigen::VectorXf> x;
+        float weight;
+        float sq_norm;  // ||w * x||^2
+    };
+    auto point = [&](Eigen::Index i) {
+        QueryEngine::RowRef row = engine.row(i);
+        float weight = options.spherical ? row.inv_norm : 1.0f;
+        return Point{Eigen::Map<const Eigen::VectorXf>(row.data, stride), weight, weight * weight * row.sq_norm};
+    };
+
+    RowMatrix centroids(k, stride);
+    Eigen::VectorXf centroid_sq_norms(k);
+    auto sq_distance = [&](const Point& p, int c) {
+        return std::max(0.0f, p.sq_norm - 2.0f * p.weight * centroids.row(c).dot(p.x) + centroid_sq_norms(c));
+    };
+
+    // k-means++: every next centroid is a row drawn with probability
+    // proportional to its squared distance from the nearest centroid so far.
+    std::mt19937 rng(options.seed);
+    std::vector<float> nearest(rows, kInfinity);
+    Eigen::Index chosen = std::uniform_int_distribution<Eigen::Index>(0, rows - 1)(rng);
+    for (int c = 0; c < k; ++c) {
+        if (c > 0) {
+            double total = 0;
+            for (float d : nearest) {
+                total += d;
+            }
+            if (total > 0) {
+                double target = std::uniform_real_distribution<double>(0, total)(rng);
+                for (chosen = 0; chosen < rows - 1 && (target -= nearest[chosen]) > 0; ++chosen) {
+                }
+            } else {
+                chosen = std::uniform_int_distribution<Eigen::Index>(0, rows - 1)(rng);
+            }
+        }
+        Point p = point(chosen);
+        centroids.row(c) = p.weight * p.x.transpose();
+        centroid_sq_norms(c) = centroids.row(c).squaredNorm();
+        parallel_for(rows, options.threads, 1024, [&](std::size_t i) {
+            nearest[i] = std::min(nearest[i], sq_distance(point(i), c));
+        });
+    }
+
+    KMeansResult result;
+    result.assignments.assign(rows, -1);
+    std::vector<float> upper(rows, kInfinity), lower(rows, 0.0f);
+    for (int iteration = 1; iteration <= options.max_iterations; ++iteration) {
+        // Half the distance from each centroid to its nearest other one: a
+        // row closer than that to its centroid cannot be closer to another.
+        RowMatrix products = centroids * centroids.transpose();
+        Eigen::VectorXf half_gap = Eigen::VectorXf::Constant(k, kInfinity);
+        for (int a = 0; a < k; ++a) {
+            for (int b = 0; b < k; ++b) {
+                if (a != b) {
+                    float d = std::max(0.0f, centroid_sq_norms(a) - 2.0f * products(a, b) + centroid_sq_norms(b));
+                    half_gap(a) = std::min(half_gap(a), 0.5f * std::sqrt(d));
+                }
+            }
+        }
+
+        std::atomic<std::size_t> moved{0};
+        parallel_for(rows, options.threads, 256, [&](std::size_t i) {
+            Point p = point(i);
+            int assigned = result.assignments[i];
+            if (assigned >= 0) {
+                float bound = std::max(half_gap(assigned), lower[i]);
+                if (upper[i] <= bound) {
+                    return;
+                }
+                upper[i] = std::sqrt(sq_distance(p, assigned));
+                if (upper[i] <= bound) {
+                    return;
+                }
+            }
+            thread_local Eigen::VectorXf dots;
+            dots.noalias() = centroids * p.x;
+            float best = kInfinity, second = kInfinity;
+            int best_c = 0;
+            for (int c = 0; c < k; ++c) {
+                float d = std::max(0.0f, p.sq_norm - 2.0f * p.weight * dots(c) + centroid_sq_norms(c));
+                if (d < best) {
+                    second = best;
+                    best = d;
+                    best_c = c;
+                } else if (d < second) {
+                    second = d;
+                }
+            }
+            if (best_c != assigned) {
+                result.assignments[i] = best_c;
+                moved++;
+            }
+            upper[i] = std::sqrt(best);
+            lower[i] = std::sqrt(second);
+        });
+
+        result.iterations = iteration;
+        if (moved.load() == 0) {
+            result.converged = true;
+            progress(iteration, 0);
+            break;
+        }
+
+        RowMatrix sums = RowMatrix::Zero(k, stride);
+        result.sizes.assign(k, 0);
+        for (Eigen::Index i = 0; i < rows; ++i) {
+            Point p = point(i);
+            sums.row(result.assignments[i]) += p.weight * p.x.transpose();
+            result.sizes[result.assignments[i]]++;
+        }
+        // Bounds follow the centroids: a row's own centroid moved at most
+        // shift(c) away, any other at most the largest other shift closer.
+        Eigen::VectorXf shift = Eigen::VectorXf::Zero(k);
+        for (int c = 0; c < k; ++c) {
+            if (result.sizes[c] > 0) {
+                Eigen::RowVectorXf updated = sums.row(c) / static_cast<float>(result.sizes[c]);
+                shift(c) = (updated - centroids.row(c)).norm();
+                centroids.row(c) = updated;
+            }
+        }
+        centroid_sq_norms = centroids.rowwise().squaredNorm();
+        Eigen::Index farthest;
+        float max_shift = shift.maxCoeff(&farthest);
+        float other_max_shift = 0;
+        for (int c = 0; c < k; ++c) {
+            if (c != farthest) {
+                other_max_shift = std::max(other_max_shift, shift(c));
+            }
+        }
+        for (Eigen::Index i = 0; i < rows; ++i) {
+            int assigned = result.assignments[i];
+            upper[i] += shift(assigned);
+            lower[i] -= assigned == farthest ? other_max_shift : max_shift;
+        }
+
+        if (!progress(iteration, moved.load())) {
+            throw KMeansCancelled();
+        }
+    }
+
+    result.sizes.assign(k, 0);
+    for (Eigen::Index i = 0; i < rows; ++i) {
+        int assigned = result.assignments[i];
+        result.sizes[assigned]++;
+        result.inertia += sq_distance(point(i), assigned);
+    }
+    result.centroids = centroids.leftCols(engine.dim());
+    return result;
+}
@@ -0,0 +1,363 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "corpus.h"
+#include "metric.h"
+#include "parallel_for.h"
+#include "query_engine.h"
+#include "self_join.h"
+#include "string_table.h"
+#include "topk.h"
+
+// Per-row neighbor lists, best first, as (ranking score, row) pairs.
+using KnnGraph = std::vector<std::vector<std::pair<float, int>>>;
+
+// Ranking score of the pair (i, j) from its dot product, for the metrics
+// that can be expressed through x.q.
+template <typename Policy>
+float pair_rank_score(float dot, const RowStats& stats, Eigen::Index i, Eigen::Index j) {
+    if constexpr (std::is_same_v<Policy, CosineMetric>) {
+        return dot * stats.inv_norms(i) * stats.inv_norms(j);
+    } else {
+        return Policy::from_dot(dot, stats, j, stats.sq_norms(i));
+    }
+}
+
+// Exact graph from the tiled self-join: every tile feeds the lists of both
+// of its row blocks, each under that block's lock.
+template <typename Policy>
+KnnGraph exact_knn_graph(const Corpus& corpus, const RowStats& stats, int k, int threads, Eigen::Index block_rows) {
+    KnnGraph graph(corpus.rows());
+    std::vector<std::mutex> block_locks((corpus.rows() + block_rows - 1) / block_rows);
+
+    for_each_self_join_tile(corpus, block_rows, threads, [&](Eigen::Index i_begin, Eigen::Index j_begin, const SelfJoinTile& tile) {
+        {
+            std::lock_guard<std::mutex> lock(block_locks[i_begin / block_rows]);
+            for (Eigen::Index a = 0; a < tile.rows(); ++a) {
+                for (Eigen::Index b = 0; b < tile.cols(); ++b) {
+                    Eigen::Index i = i_begin + a, j = j_begin + b;
+                    if (i != j) {
+                        push_topk<Policy>(graph[i], k, pair_rank_score<Policy>(tile(a, b), stats, i, j), j);
+                    }
+                }
+            }
+        }
+        if (i_begin != j_begin) {
+            std::lock_guard<std::mutex> lock(block_locks[j_begin / block_rows]);
+            for (Eigen::Index b = 0; b < tile.cols(); ++b) {
+                for (Eigen::Index a = 0; a < tile.rows(); ++a) {
+                    Eigen::Index i = i_begin + a, j = j_begin + b;
+                    push_topk<Policy>(graph[j], k, pair_rank_score<Policy>(tile(a, b), stats, j, i), i);
+                }
+            }
+        }
+    });
+
+    for (auto& neighbors : graph) {
+        finish_topk<Policy>(neighbors);
+    }
+    return graph;
+}
+
+struct NNDescentOptions {
+    int iterations = 10;
+    float sample_rate = 0.5f;  // rho: share of each list joined per iteration
+    float delta = 0.001f;      // stop once fewer than delta * N * k lists change
+    unsigned seed = 42;
+};
+
+// Approximate graph by NN-descent (Dong et al., 2011): a neighbor of a
+// neighbor is likely a neighbor. Starting from random lists, every
+// iteration joins each row's sampled new and old neighbors, forward and
+// reverse, with each other and keeps the improvements, so the work per
+// iteration is O(N (rho k)^2) instead of O(N^2). Lists are guarded by
+// striped locks and never locked two at a time.
+template <typename Policy>
+KnnGraph nn_descent_knn_graph(const Corpus& corpus, const RowStats& stats, int k, int threads, const NNDescentOptions& options,
+                              std::uint64_t& evaluations) {
+    struct Neighbor {
+        float score;
+        int row;
+        bool fresh;
+    };
+    auto better = [](const Neighbor& a, const Neighbor& b) { return topk_better<Policy>({a.score, a.row}, {b.score, b.row}); };
+
+    const int rows = static_cast<int>(corpus.rows());
+    k = std::min(k, rows - 1);
+    std::vector<std::vector<Neighbor>> lists(rows);
+    constexpr std::size_t kStripes = 4096;
+    std::vector<std::mutex> stripes(kStripes);
+    std::atomic<std::uint64_t> scored{0};
+
+    auto score = [&](int a, int b) {
+        Eigen::Map<const Eigen::VectorXf> x(corpus.row(a), corpus.stride()), y(corpus.row(b), corpus.stride());
+        return pair_rank_score<Policy>(x.dot(y), stats, a, b);
+    };
+    // Inserts b into a's list; false if it is already there or not better
+    // than the current worst.
+    auto insert = [&](int a, int b, float s) {
+        std::lock_guard<std::mutex> lock(stripes[a % kStripes]);
+        auto& list = lists[a];
+        for (const Neighbor& n : list) {
+            if (n.row == b) {
+                return false;
+            }
+        }
+        Neighbor candidate{s, b, true};
+        if (static_cast<int>(list.size()) < k) {
+            list.push_back(candidate);
+            std::push_heap(list.begin(), list.end(), better);
+            return true;
+        }
+        if (!better(candidate, list.front())) {
+            return false;
+        }
+        std::pop_heap(list.begin(), list.end(), better);
+        list.back() = candidate;
+        std::push_heap(list.begin(), list.end(), better);
+        return true;
+    };
+
+    std::mt19937 rng(options.seed);
+    std::uniform_int_distribution<int> any_row(0, rows - 1);
+    for (int v = 0; v < rows; ++v) {
+        while (static_cast<int>(lists[v].size()) < k) {
+            int u = any_row(rng);
+            if (u != v) {
+                insert(v, u, score(v, u));
+            }
+        }
+    }
+    evaluations = static_cast<std::uint64_t>(rows) * k;
+
+    std::size_t sample = std::max(1, static_cast<int>(options.sample_rate * k));
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<std::vector<int>> fresh(rows), old(rows), reverse_fresh(rows), reverse_old(rows);
+    for (int iteration = 0; iteration < options.iterations; ++iteration) {
+        for (int v = 0; v < rows; ++v) {
+            fresh[v].clear();
+            old[v].clear();
+            reverse_fresh[v].clear();
+            reverse_old[v].clear();
+        }
+        for (int v = 0; v < rows; ++v) {
+            for (Neighbor& n : lists[v]) {
+                if (!n.fresh) {
+                    old[v].push_back(n.row);
+                } else if (unit(rng) < options.sample_rate) {
+                    fresh[v].push_back(n.row);
+                    n.fresh = false;
+                }
+            }
+            for (int u : fresh[v]) {
+                reverse_fresh[u].push_back(v);
+            }
+            for (int u : old[v]) {
+                reverse_old[u].push_back(v);
+            }
+        }
+        for (int v = 0; v < rows; ++v) {
+            for (auto [forward, reverse] : {std::pair(&fresh[v], &reverse_fresh[v]), std::pair(&old[v], &reverse_old[v])}) {
+                std::shuffle(reverse->begin(), reverse->end(), rng);
+                reverse->resize(std::min(reverse->size(), sample));
+                forward->insert(forward->end(), reverse->begin(), reverse->end());
+                std::sort(forward->begin(), forward->end());
+                forward->erase(std::unique(forward->begin(), forward->end()), forward->end());
+            }
+        }
+
+        std::atomic<std::uint64_t> updates{0};
+        parallel_for(rows, threads, 256, [&](std::size_t v) {
+            std::uint64_t changed = 0, pairs = 0;
+            auto join = [&](int a, int b) {
+                if (a == b) {
+                    return;
+                }
+                float s = score(a, b);
+                pairs++;
+                changed += insert(a, b, s);
+                changed += insert(b, a, s);
+            };
+            const auto& f = fresh[v];
+            for (std::size_t i = 0; i < f.size(); ++i) {
+                for (std::size_t j = i + 1; j < f.size(); ++j) {
+                    join(f[i], f[j]);
+                }
+                for (int u : old[v]) {
+                    join(f[i], u);
+                }
+            }
+            updates += changed;
+            scored += pairs;
+        });
+
+        std::cout << "  iteration " << iteration + 1 << ": " << updates.load() << " updates\n";
+        if (updates.load() <= options.delta * rows * k) {
+            break;
+        }
+    }
+    evaluations += scored.load();
+
+    KnnGraph graph(rows);
+    for (int v = 0; v < rows; ++v) {
+        for (const Neighbor& n : lists[v]) {
+            graph[v].emplace_back(n.score, n.row);
+        }
+        std::sort(graph[v].begin(), graph[v].end(), topk_better<Policy>);
+    }
+    return graph;
+}
+
+// Share of the top-k inner product rows of `samples` random queries that
+// are also the euclidean top-k of the query after mips_query_to_l2 over the
+// corpus after mips_to_l2; 1 but for ties, as the reduction is exact for
+// queries. It is not for pairs of corpus rows, whose distance also carries
+// the product of their extra coordinates, so the "dot" graph itself is built
+// from inner products: NN-descent over the augmented rows finds far fewer
+// of the MIPS neighbors.
+inline double mips_reduction_agreement(const Corpus& corpus, int k, int samples, unsigned seed) {
+    Corpus augmented = mips_to_l2(corpus);
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> normal;
+    std::size_t found = 0, wanted = 0;
+    for (int s = 0; s < samples; ++s) {
+        Eigen::VectorXf query(corpus.dim());
+        for (Eigen::Index d = 0; d < query.size(); ++d) {
+            query(d) = normal(rng);
+        }
+        Eigen::VectorXf padded = Eigen::VectorXf::Zero(corpus.stride());
+        padded.head(corpus.dim()) = query;
+        Eigen::VectorXf augmented_query = Eigen::VectorXf::Zero(augmented.stride());
+        augmented_query.head(corpus.dim() + 1) = mips_query_to_l2(query);
+        Eigen::VectorXf dots = corpus.matrix() * padded;
+        Eigen::VectorXf distances = (augmented.matrix().rowwise() - augmented_query.transpose()).rowwise().squaredNorm();
+        std::vector<std::pair<float, int>> by_dot, by_distance;
+        for (Eigen::Index j = 0; j < corpus.rows(); ++j) {
+            push_topk<DotMetric>(by_dot, k, dots(j), j);
+            push_topk<EuclideanMetric>(by_distance, k, distances(j), j);
+        }
+        for (const auto& [score, row] : by_dot) {
+            found += std::any_of(by_distance.begin(), by_distance.end(), [row = row](const auto& n) { return n.second == row; });
+        }
+        wanted += by_dot.size();
+    }
+    return wanted ? static_cast<double>(found) / wanted : 1.0;
+}
+
+// Share of the exact k nearest neighbors found, over `samples` random rows.
+template <typename Policy>
+double knn_graph_recall(const Corpus& corpus, const RowStats& stats, const KnnGraph& graph, int k, int samples, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<Eigen::Index> any_row(0, corpus.rows() - 1);
+    std::size_t found = 0, wanted = 0;
+    for (int s = 0; s < samples; ++s) {
+        Eigen::Index v = any_row(rng);
+        Eigen::VectorXf query = Eigen::Map<const Eigen::VectorXf>(corpus.row(v), corpus.stride());
+        Eigen::VectorXf dots = corpus.matrix() * query;
+        std::vector<std::pair<float, int>> exact;
+        for (Eigen::Index j = 0; j < corpus.rows(); ++j) {
+            if (j != v) {
+                push_topk<Policy>(exact, k, pair_rank_score<Policy>(dots(j), stats, v, j), j);
+            }
+        }
+        for (const auto& [score, row] : exact) {
+            found += std::any_of(graph[v].begin(), graph[v].end(), [row = row](const auto& n) { return n.second == row; });
+        }
+        wanted += exact.size();
+    }
+    return wanted ? static_cast<double>(found) / wanted : 1.0;
+}
+
+// Binary adjacency file, native byte order:
+//   "KNNG1\0\0\0", rows (u64), k (u32), metric (u32),
+//   neighbor rows (i32 x rows*k, best first, -1 past the end of a short list),
+//   scores (f32 x rows*k, in the units /query reports)
+// Row i is the image at index i of the StringTable saved to <path>.paths.
+template <typename Policy>
+void save_knn_graph(const std::string& path, const KnnGraph& graph, int k, const StringTable& image_paths) {
+    std::vector<std::int32_t> neighbors(graph.size() * k, -1);
+    std::vector<float> scores(graph.size() * k, 0.0f);
+    for (std::size_t v = 0; v < graph.size(); ++v) {
+        for (std::size_t n = 0; n < graph[v].size(); ++n) {
+            neighbors[v * k + n] = graph[v][n].second;
+            scores[v * k + n] = Policy::finalize(graph[v][n].first);
+        }
+    }
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    std::uint64_t rows = graph.size();
+    std::uint32_t header[2] = {static_cast<std::uint32_t>(k), static_cast<std::uint32_t>(Policy::kind)};
+    file.write("KNNG1\0\0\0", 8);
+    file.write(reinterpret_cast<const char*>(&rows), sizeof(rows));
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(neighbors.data()), neighbors.size() * sizeof(std::int32_t));
+    file.write(reinterpret_cast<const char*>(scores.data()), scores.size() * sizeof(float));
+    if (!file) {
+        throw std::runtime_error("Could not write k-NN graph: " + path);
+    }
+    image_paths.save(path + ".paths");
+}
+
+// `myserver knn_graph --k 10 --method exact|nndescent --mode cosine --output knn.bin`
+// Builds the k-NN graph of the corpus, reports its throughput and its recall
+// against exact search on sampled rows, and writes it with save_knn_graph.
+// For "dot" it also checks the MIPS -> L2 reduction an L2 graph index would
+// search it through.
+inline int run_knn_graph(const std::string& embedding_dir, int k, const std::string& method, const std::string& mode,
+                         const std::string& output, int threads, Eigen::Index block_rows, const NNDescentOptions& options) {
+    Metric metric = parse_metric(mode);
+    if (method != "exact" && method != "nndescent") {
+        std::cerr << "Unknown method: " << method << "\n";
+        return 1;
+    }
+    auto [corpus, image_paths] = load_embeddings(embedding_dir);
+    if (corpus.rows() < 2 || k < 1) {
+        std::cerr << "Need at least two rows and k >= 1\n";
+        return 1;
+    }
+    RowStats stats = RowStats::compute(corpus);
+    std::cout << "knn_graph rows=" << corpus.rows() << " dim=" << corpus.dim() << " k=" << k << " method=" << method
+              << " mode=" << mode << " threads=" << threads << "\n";
+
+    return dispatch_metric(metric, [&](auto policy) {
+        using Policy = decltype(policy);
+        if constexpr (!Policy::supports_gemm) {
+            std::cerr << "knn_graph supports cosine, dot and euclidean\n";
+            return 1;
+        } else {
+            auto start = std::chrono::steady_clock::now();
+            KnnGraph graph;
+            std::uint64_t evaluations = static_cast<std::uint64_t>(corpus.rows()) * (corpus.rows() - 1) / 2;
+            if (method == "exact") {
+                graph = exact_knn_graph<Policy>(corpus, stats, k, threads, block_rows);
+            } else {
+                graph = nn_descent_knn_graph<Policy>(corpus, stats, k, threads, options, evaluations);
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "built in " << seconds << " s: " << corpus.rows() / seconds << " rows/s, " << evaluations
+                      << " pair scores (" << 100.0 * evaluations / (corpus.rows() * (corpus.rows() - 1) / 2.0) << "% of all pairs)\n";
+            std::cout << "recall@" << k << " on 100 sampled rows: " << knn_graph_recall<Policy>(corpus, stats, graph, k, 100, options.seed)
+                      << "\n";
+            if constexpr (std::is_same_v<Policy, DotMetric>) {
+                std::cout << "MIPS->L2 reduction agreement@" << k << " on 100 random queries: "
+                          << mips_reduction_agreement(corpus, k, 100, options.seed) << "\n";
+            }
+            save_knn_graph<Policy>(output, graph, std::min<int>(k, corpus.rows() - 1), image_paths);
+            std::cout << "written to " << output << " and " << output << ".paths\n";
+            return 0;
+        }
+    });
+}
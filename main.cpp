@@ -1,132 +1,97 @@
+#include <Eigen/Dense>
 #include "httplib.h"
 #include <iostream>
 #include <nlohmann/json.hpp>
-#include <Eigen/Dense>
-#include <filesystem>
 #include <fstream>
 #include <vector>
-#include <queue>
 #include <string>
 
-namespace fs = std::filesystem;
+#include "admission.h"
+#include "bench.h"
+#include "cluster_jobs.h"
+#include "collections.h"
+#include "dedup.h"
+#include "epoll_server.h"
+#include "file_cache.h"
+#include "json_writer.h"
+#include "knn_graph.h"
+#include "multi_vector.h"
+#include "query_batcher.h"
+#include "query_cache.h"
+#include "query_engine.h"
+#include "thumbnails.h"
 
-std::string embedding_path_to_image_path(const std::string& embedding_path) {
-    std::string image_path = embedding_path;
-    return image_path.replace(image_path.find("embedding"), 9, "raw-img").replace(image_path.find(".json"), 5, ".jpg");
-}
-
-std::string image_path_to_embedding_path(const std::string& image_path) {
-    std::string embedding_path = image_path;
-    return embedding_path.replace(embedding_path.find("raw-img"), 7, "embedding").replace(embedding_path.find(".jpg"), 4, ".json");
+void enable_cors(httplib::Response &res) {
+    res.set_header("Access-Control-Allow-Origin", "*");
+    res.set_header("Access-Control-Allow-Methods", "GET, POST, PUT, DELETE, OPTIONS");
+    res.set_header("Access-Control-Allow-Headers", "Content-Type");
 }
 
-std::pair<Eigen::MatrixXf, std::vector<std::string>> load_embeddings(const std::string& directory) {
-    std::vector<std::vector<float>> embeddings_list;
-    std::vector<std::string> file_paths;
-    std::size_t feature_size = -1;
-
-    for (const auto& entry : fs::recursive_directory_iterator(directory)) {
-        if (entry.path().extension() == ".json") {
-            std::ifstream file(entry.path());
-            if (!file.is_open()) {
-                std::cerr << "Warning: Could not open file: " << entry.path() << "\n";
-                continue;
-            }
-
-            try {
-                nlohmann::json j;
-                file >> j;
-                std::vector<float> embedding = j.get<std::vector<float>>();
-
-                if (feature_size == -1) {
-                    feature_size = embedding.size();
-                } else if (embedding.size() != feature_size) {
-                    std::cerr << "Skipping " << entry.path() << " due to size mismatch.\n";
-                    continue;
-                }
-
-                embeddings_list.push_back(embedding);
-                file_paths.push_back(entry.path().string());
-            } catch (const std::exception& e) {
-                std::cerr << "Error parsing file " << entry.path() << ": " << e.what() << "\n";
-            }
-        }
+// {"matches": [{"file": ..., "score": ...}, ...], "next_cursor": ...}, written
+// straight into one preallocated string; for large topk a DOM costs more than
+// the scan itself. A full page of `page_size` gets a cursor for the page after
+// it, valid for collection generation `generation` only; 0 means the results
+// cannot be paged (diversified results are not in score order).
+std::string query_response_json(const QueryResults& results, int page_size, Metric metric, std::uint64_t generation) {
+    std::size_t bytes = 48;
+    for (const Match& match : results) {
+        bytes += match.file.size() + 40;
     }
-
-    Eigen::MatrixXf embeddings(embeddings_list.size(), feature_size);
-    for (size_t i = 0; i < embeddings_list.size(); ++i) {
-        embeddings.row(i) = Eigen::VectorXf::Map(embeddings_list[i].data(), feature_size);
+    std::string body;
+    body.reserve(bytes);
+    JsonWriter json(body);
+    json.raw("{\"matches\":[");
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        json.raw(i == 0 ? "{\"file\":" : ",{\"file\":").string(results[i].file);
+        json.raw(",\"score\":").number(results[i].score).raw("}");
     }
-
-    return {embeddings, file_paths};
+    json.raw("]");
+    if (page_size > 0 && static_cast<int>(results.size()) == page_size) {
+        json.raw(",\"next_cursor\":").string(Cursor::after(results.back()).encode(metric, generation));
+    }
+    json.raw("}");
+    return body;
 }
 
-class QueryEngine {
-private:
-    Eigen::MatrixXf embeddings;
-    std::vector<std::string> file_paths;
-
-public:
-    QueryEngine(const Eigen::MatrixXf& embeddings, const std::vector<std::string>& file_paths)
-        : embeddings(embeddings), file_paths(file_paths) {}
-
-    std::vector<std::pair<std::string, float>> query(const Eigen::VectorXf& query_embedding, int topk, const std::string& mode = "cosine") {
-        std::vector<std::pair<float, int>> topk_indices;
-
-        if (mode == "cosine") {
-            Eigen::VectorXf query_norm = query_embedding.normalized();
-            Eigen::MatrixXf embeddings_norm = embeddings.rowwise().normalized();
-            Eigen::VectorXf similarities = embeddings_norm * query_norm;
-
-            auto compare = [](const std::pair<float, int>& a, const std::pair<float, int>& b) {
-                return a.first < b.first;  // Max heap for highest similarity
-            };
-            std::priority_queue<std::pair<float, int>, std::vector<std::pair<float, int>>, decltype(compare)> pq(compare);
-
-            for (int i = 0; i < similarities.size(); ++i) {
-                pq.emplace(similarities(i), i);
-            }
-            
-            for (int i = 0; i < topk && !pq.empty(); ++i) {
-                topk_indices.push_back(pq.top());
-                pq.pop();
-            }
-
-        } else if (mode == "euclidean") {
-            Eigen::VectorXf distances = (embeddings.rowwise() - query_embedding.transpose()).rowwise().norm();
-
-            auto compare = [](const std::pair<float, int>& a, const std::pair<float, int>& b) {
-                return a.first > b.first;  // Min heap for smallest distance
-            };
-            std::priority_queue<std::pair<float, int>, std::vector<std::pair<float, int>>, decltype(compare)> pq(compare);
-
-            for (int i = 0; i < distances.size(); ++i) {
-                pq.emplace(distances(i), i);
-            }
-
-            for (int i = 0; i < topk && !pq.empty(); ++i) {
-                topk_indices.push_back(pq.top());
-                pq.pop();
-            }
-
-        } else {
-            throw std::invalid_argument("Invalid mode: " + mode);
-        }
-
-        std::vector<std::pair<std::string, float>> results;
-        for (const auto& [value, idx] : topk_indices) {
-            results.emplace_back(embedding_path_to_image_path(file_paths[idx]), value);
-        }
+nlohmann::json collection_json(const Collection& collection) {
+    return {{"name", collection.name},
+            {"generation", collection.generation},
+            {"path", collection.path},
+            {"index", collection.index},
+            {"mode", metric_name(collection.metric)},
+            {"rows", collection.engine->size() - collection.engine->deleted_rows()},
+            {"dim", collection.engine->dim()},
+            {"segments", collection.engine->corpus_shards().size()},
+            {"deleted_rows", collection.engine->deleted_rows()},
+            {"bytes", collection.engine->corpus_bytes()}};
+}
 
-        return results;
+nlohmann::json reload_json(const CollectionRegistry::ReloadStatus& status) {
+    nlohmann::json json = {{"state", status.state},
+                           {"reloads", status.reloads},
+                           {"load_ms", status.load_ms},
+                           {"swap_us", status.swap_us},
+                           {"overlap_bytes", status.overlap_bytes}};
+    if (status.retired_after_ms >= 0) {
+        json["retired_after_ms"] = status.retired_after_ms;
     }
-};
-
+    if (!status.error.empty()) {
+        json["error"] = status.error;
+    }
+    return json;
+}
 
-void enable_cors(httplib::Response &res) {
-    res.set_header("Access-Control-Allow-Origin", "*");
-    res.set_header("Access-Control-Allow-Methods", "GET, POST, OPTIONS");
-    res.set_header("Access-Control-Allow-Headers", "Content-Type");
+nlohmann::json mutation_json(const MutationStore::Stats& stats) {
+    return {{"sequence", stats.sequence},
+            {"checkpoint_sequence", stats.checkpoint_sequence},
+            {"wal_bytes", stats.wal_bytes},
+            {"files", stats.files},
+            {"mutations", stats.mutations},
+            {"group_commits", stats.group_commits},
+            {"checkpoints", stats.checkpoints},
+            {"recovered", stats.recovered},
+            {"replayed", stats.replayed},
+            {"recovery_ms", stats.recovery_ms}};
 }
 
 std::unordered_map<std::string, std::string> read_image_name_to_path() {
@@ -136,96 +101,655 @@ std::unordered_map<std::string, std::string> read_image_name_to_path() {
     return j.get<std::unordered_map<std::string, std::string>>();
 }
 
-int main() {
-    httplib::Server svr;
-
-    std::cout << "Loading embeddings..." << std::endl;
-    auto [embeddings, file_paths] = load_embeddings("animals10/embedding/");
-    auto image_name_to_path = read_image_name_to_path();
-    QueryEngine query_engine(embeddings, file_paths);
-    std::cout << "Loaded " << embeddings.rows() << " embeddings.\n";
+// `myserver [command] [--flag value ...]`, in the spirit of the Fire CLI in
+// prepare_data.py. Without a command the search server is started.
+std::unordered_map<std::string, std::string> parse_flags(int argc, char** argv, int first) {
+    std::unordered_map<std::string, std::string> flags;
+    for (int i = first; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            throw std::invalid_argument("Unexpected argument: " + arg);
+        }
+        std::string value = (i + 1 < argc && std::string(argv[i + 1]).rfind("--", 0) != 0) ? argv[++i] : "true";
+        flags[arg.substr(2)] = value;
+    }
+    return flags;
+}
 
-    svr.Options(".*", [](const httplib::Request&, httplib::Response& res) {
-        enable_cors(res);
-        res.status = 200;
-    });
+long flag_int(const std::unordered_map<std::string, std::string>& flags, const std::string& name, long default_value) {
+    auto it = flags.find(name);
+    return it == flags.end() ? default_value : std::stol(it->second);
+}
 
-    svr.Get("/health", [](const httplib::Request&, httplib::Response& res) {
-        enable_cors(res);
-        res.set_content("OK", "text/plain");
-    });
+int main(int argc, char** argv) {
+    bool has_command = argc > 1 && std::string(argv[1]).rfind("--", 0) != 0;
+    std::string command = has_command ? argv[1] : "serve";
+    auto flags = parse_flags(argc, argv, has_command ? 2 : 1);
+    huge_pages_enabled() = flags.count("huge_pages") == 0 || flags["huge_pages"] != "false";
+    const std::string embedding_dir = "animals10/embedding/";
+
+    if (command == "bench_scan") {
+        return run_bench_scan(flag_int(flags, "rows", 200000), flag_int(flags, "dim", 1280), flag_int(flags, "iters", 10));
+    } else if (command == "check_allocations") {
+        return run_check_allocations(flag_int(flags, "rows", 100000), flag_int(flags, "dim", 1280), flag_int(flags, "topk", 10),
+                                     flag_int(flags, "queries", 100));
+    } else if (command == "check_segments") {
+        return run_check_segments(flag_int(flags, "rows", 20000), flag_int(flags, "dim", 64), flag_int(flags, "groups", 200));
+    } else if (command == "dedup") {
+        return run_dedup(embedding_dir, flags.count("min_score") ? std::stof(flags["min_score"]) : 0.95f,
+                         flags.count("output") ? flags["output"] : "duplicates.tsv",
+                         flag_int(flags, "threads", std::max(1u, std::thread::hardware_concurrency())), flag_int(flags, "block_rows", 2048));
+    } else if (command == "knn_graph") {
+        NNDescentOptions options;
+        options.iterations = flag_int(flags, "iterations", options.iterations);
+        options.sample_rate = flags.count("sample_rate") ? std::stof(flags["sample_rate"]) : options.sample_rate;
+        options.delta = flags.count("delta") ? std::stof(flags["delta"]) : options.delta;
+        options.seed = flag_int(flags, "seed", options.seed);
+        return run_knn_graph(embedding_dir, flag_int(flags, "k", 10), flags.count("method") ? flags["method"] : "exact",
+                             flags.count("mode") ? flags["mode"] : "cosine", flags.count("output") ? flags["output"] : "knn.bin",
+                             flag_int(flags, "threads", std::max(1u, std::thread::hardware_concurrency())),
+                             flag_int(flags, "block_rows", 2048), options);
+#ifdef __linux__
+    } else if (command == "check_wal") {
+        return run_check_wal(flags.count("dir") ? flags["dir"] : "check_wal");
+    } else if (command == "bench_connections") {
+        return run_bench_connections(flag_int(flags, "connections", 1000), flag_int(flags, "threads", CPPHTTPLIB_THREAD_POOL_COUNT),
+                                     flag_int(flags, "io_threads", 2), flag_int(flags, "max_queued", 256),
+                                     flag_int(flags, "rounds", 2), flag_int(flags, "timeout_s", 10));
+#endif
+    } else if (command != "serve") {
+        std::cerr << "Unknown command: " << command << "\n";
+        return 1;
+    }
 
-    svr.Get("/get_image_info", [&](const httplib::Request& req, httplib::Response& res) {
+    // Connections are served by --threads workers with at most --max_queued
+    // waiting; /query scans run on a separate pool of --query_threads with at
+    // most --max_queued_queries waiting, so cheap endpoints stay responsive
+    // while queries queue. Overflow on either side is answered with 503.
+    // With --frontend epoll, --io_threads event loops own the connections and
+    // the --threads workers only run handlers for fully received requests.
+    httplib::Server svr;
+    std::size_t server_threads = flag_int(flags, "threads", CPPHTTPLIB_THREAD_POOL_COUNT);
+    std::size_t max_queued = flag_int(flags, "max_queued", 256);
+    svr.new_task_queue = [=] { return new AdmissionTaskQueue(server_threads, max_queued); };
+    auto overloaded = [](const httplib::Request&, httplib::Response& res) {
         enable_cors(res);
-
-        std::string file_name = req.get_param_value("file");
-        std::string file_path = image_name_to_path[file_name];
-        std::string embedding_path = image_path_to_embedding_path(file_path);
-        std::cout << "file_path: " << file_path << std::endl;
-        std::ifstream file(embedding_path);
-        if (!file.is_open()) {
-            res.status = 404;
-            res.set_content("File not found", "text/plain");
-            return;
+        res.status = 503;
+        res.set_header("Connection", "close");
+        res.set_header("Retry-After", "1");
+        res.set_content("Server overloaded", "text/plain");
+    };
+    svr.set_pre_routing_handler([&](const httplib::Request& req, httplib::Response& res) {
+        if (!AdmissionTaskQueue::rejecting()) {
+            return httplib::Server::HandlerResponse::Unhandled;
         }
-        nlohmann::json embedding_json;
-        file >> embedding_json;
-    
-        nlohmann::json response;
-        response["embedding"] = embedding_json;
-        response["file_path"] = file_path;
-
-        res.set_content(response.dump(), "application/json");
+        overloaded(req, res);
+        return httplib::Server::HandlerResponse::Handled;
     });
 
-    svr.Get("/get_image", [](const httplib::Request& req, httplib::Response& res) {
-        enable_cors(res);
-        if (!req.has_param("file")) {
-            res.status = 400;
-            res.set_content("Missing file parameter", "text/plain");
-            return;
-        }
+    std::size_t query_threads = flag_int(flags, "query_threads", std::max(1u, std::thread::hardware_concurrency()));
+    httplib::ThreadPool query_pool(query_threads, flag_int(flags, "max_queued_queries", 64));
+    long default_timeout_ms = flag_int(flags, "query_timeout_ms", 0);
+    // Page size of range searches, which would otherwise return any number
+    // of rows; the rest is fetched with the returned cursor.
+    int max_range_results = flag_int(flags, "max_range_results", 10000);
+    // Largest candidate pool a diversified query may rerank.
+    int max_diversify_candidates = flag_int(flags, "max_diversify_candidates", 10000);
+    std::atomic<std::uint64_t> rejected_queries{0};
+    std::atomic<std::uint64_t> expired_queries{0};
 
-        std::string file_path =  req.get_param_value("file");
-        std::ifstream file(file_path, std::ios::binary);
-        if (!file.is_open()) {
-            res.status = 404;
-            res.set_content("File not found", "text/plain");
-            return;
+    std::cout << "Loading embeddings..." << std::endl;
+    std::optional<NumaTopology> topology;
+    long numa_partitions = flag_int(flags, "numa_partitions", 0);
+    if (flags["numa"] == "true" || numa_partitions > 0) {
+        topology = detect_numa_topology();
+        if (numa_partitions > 0) {
+            topology = simulate_partitions(*topology, numa_partitions);
         }
+        std::cout << "Sharding corpora over " << topology->partitions.size() << " NUMA partitions.\n";
+    }
+    auto load_engine = [&](const std::string& directory) {
+        if (topology) {
+            return std::make_unique<QueryEngine>(load_embeddings_sharded(directory, *topology), *topology);
+        }
+        auto [embeddings, image_paths] = load_embeddings(directory);
+        return std::make_unique<QueryEngine>(std::move(embeddings), std::move(image_paths));
+    };
+    // The corpus in embedding_dir is the "default" collection behind /query
+    // and /cluster; more are added through /collections, within
+    // --collection_mb of corpus memory in total (0 for no limit). Every
+    // collection can be reloaded in the background, and with
+    // --reload_watch_s those whose files changed are reloaded automatically.
+    // Upserts and deletes are logged under --data_dir and checkpointed every
+    // --checkpoint_wal_mb of log or --checkpoint_interval_s seconds. New rows
+    // collect in a memtable segment of up to --memtable_rows, and sealed
+    // segments are merged --merge_factor at a time in the background.
+    MutationStore::Options durability;
+    durability.directory = flags.count("data_dir") ? flags["data_dir"] : durability.directory;
+    durability.checkpoint_bytes = static_cast<std::size_t>(flag_int(flags, "checkpoint_wal_mb", 64)) << 20;
+    durability.checkpoint_interval = std::chrono::seconds(flag_int(flags, "checkpoint_interval_s", 300));
+    SegmentOptions segment_options;
+    segment_options.memtable_rows = flag_int(flags, "memtable_rows", segment_options.memtable_rows);
+    segment_options.merge_factor = flag_int(flags, "merge_factor", segment_options.merge_factor);
+    CollectionRegistry collections(load_engine, static_cast<std::size_t>(flag_int(flags, "collection_mb", 0)) << 20,
+                                   std::chrono::seconds(flag_int(flags, "reload_watch_s", 0)), durability,
+                                   segment_options);
+    auto default_slot = collections.add_pinned("default", embedding_dir, Metric::Cosine, load_engine(embedding_dir));
+    {
+        auto initial = default_slot->load();
+        const QueryEngine& query_engine = *initial->engine;
+        std::cout << "Loaded " << query_engine.size() << " embeddings.\n";
+        std::cout << "Corpus: " << query_engine.corpus_bytes() / (1 << 20) << " MB, "
+                  << query_engine.huge_page_bytes() / (1 << 20) << " MB on huge pages ("
+                  << page_backing_name(query_engine.corpus_shards().front().embeddings().backing()) << ")\n";
+    }
+    auto image_name_to_path = read_image_name_to_path();
+    ClusterJobs cluster_jobs(flag_int(flags, "cluster_threads", std::max(1u, std::thread::hardware_concurrency() / 2)));
+    std::unique_ptr<QueryBatcher> query_batcher;
+    if (flag_int(flags, "batch_max", 1) > 1) {
+        query_batcher = std::make_unique<QueryBatcher>(flag_int(flags, "batch_max", 1),
+                                                       std::chrono::microseconds(flag_int(flags, "batch_window_us", 500)),
+                                                       flag_int(flags, "batch_threads", 1), flag_int(flags, "max_queued_queries", 64));
+    }
+    OpenFileCache open_files(flag_int(flags, "open_files", 1024));
+    ThumbnailStore thumbnails = ThumbnailStore::load(flags.count("thumbnail_dir") ? flags["thumbnail_dir"] : "animals10/thumbnails");
+    QueryCache query_cache(flag_int(flags, "cache_mb", 64) << 20, std::chrono::seconds(flag_int(flags, "cache_ttl_s", 60)));
+    for (int size : thumbnails.sizes()) {
+        std::cout << "Thumbnails: " << size << "px\n";
+    }
 
-        std::stringstream buffer;
-        buffer << file.rdbuf();
-        res.set_content(buffer.str(), "image/jpeg");
-    });
-
-
-    svr.Post("/query", [&query_engine](const httplib::Request& req, httplib::Response& res) {
+    // /query and /collections/{name}/query. Queries of every collection share
+    // the query pool, the batcher and the cache. `current` pins the collection
+    // generation the query started on until its response is written.
+    auto handle_query = [&](std::shared_ptr<const Collection> current, const httplib::Request& req, httplib::Response& res) {
+        const Collection& collection = *current;
+        const QueryEngine& engine = *collection.engine;
         enable_cors(res);
+        auto arrived = std::chrono::steady_clock::now();
         try {
             auto json = nlohmann::json::parse(req.body);
-            std::vector<float> embedding_vector = json["embedding"].get<std::vector<float>>();
-
-            Eigen::VectorXf query_embedding = Eigen::Map<Eigen::VectorXf>(embedding_vector.data(), embedding_vector.size());
-            int topk = json.value("topk", 5);
-            std::string mode = json.value("mode", "cosine");
-
-            auto results = query_engine.query(query_embedding, topk, mode);
+            // Multi-vector queries give "positive"/"negative" examples
+            // instead of one "embedding" (see multi_vector.h).
+            bool multi_vector = json.contains("positive") || json.contains("negative");
+            if (multi_vector && json.contains("embedding")) {
+                throw std::invalid_argument("embedding does not apply to positive/negative queries");
+            }
+            Eigen::VectorXf query_embedding;
+            if (!multi_vector) {
+                std::vector<float> embedding_vector = json["embedding"].get<std::vector<float>>();
+                query_embedding = Eigen::Map<Eigen::VectorXf>(embedding_vector.data(), embedding_vector.size());
+            }
+            std::string mode = json.value("mode", metric_name(collection.metric));
+            Metric metric = parse_metric(mode);
+
+            // Range search: "min_score" for similarities, "radius" for
+            // distances. topk then only caps the page.
+            bool similarity = dispatch_metric(metric, [](auto policy) { return decltype(policy)::higher_is_better; });
+            std::string threshold_key = similarity ? "min_score" : "radius";
+            std::string other_key = similarity ? "radius" : "min_score";
+            if (json.contains(other_key)) {
+                throw std::invalid_argument(other_key + " does not apply to mode " + mode);
+            }
+            std::optional<float> threshold;
+            std::string threshold_text;
+            if (json.contains(threshold_key)) {
+                threshold = json[threshold_key].get<float>();
+                threshold_text = json[threshold_key].dump();
+            }
+            int topk = json.value("topk", threshold ? max_range_results : 5);
+            if (threshold) {
+                topk = std::min(topk, max_range_results);
+            }
+            std::string cursor = json.value("cursor", "");
+            // MMR reranking: {"lambda": 0..1, "candidates": pool size}.
+            std::optional<QueryRequest::Diversify> diversify;
+            std::string diversify_text;
+            if (json.contains("diversify")) {
+                const auto& options = json["diversify"];
+                diversify.emplace();
+                diversify->lambda = options.value("lambda", diversify->lambda);
+                diversify->candidates = options.value("candidates", diversify->candidates);
+                if (!(diversify->lambda >= 0.0f && diversify->lambda <= 1.0f)) {
+                    throw std::invalid_argument("diversify.lambda must be between 0 and 1");
+                }
+                if (diversify->candidates < 0 || diversify->candidates > max_diversify_candidates) {
+                    throw std::invalid_argument("diversify.candidates must be between 0 and " +
+                                                std::to_string(max_diversify_candidates));
+                }
+                if (!cursor.empty()) {
+                    throw std::invalid_argument("cursor does not apply to diversified queries");
+                }
+                diversify_text = options.dump();
+            }
+            long timeout_ms = json.value("timeout_ms", default_timeout_ms);
+            Deadline deadline = timeout_ms > 0 ? arrived + std::chrono::milliseconds(timeout_ms) : kNoDeadline;
+
+            QueryRequest request;
+            request.embedding = std::move(query_embedding);
+            request.topk = topk;
+            request.metric = metric;
+            request.deadline = deadline;
+            request.threshold = threshold;
+            request.diversify = diversify;
+            if (multi_vector) {
+                parse_examples(engine, json, request);
+            }
+            // A centroid query is keyed by its combined embedding, and any
+            // query by the example rows it leaves out.
+            std::string examples_text;
+            if (request.examples) {
+                examples_text = std::to_string(request.examples->positives) + (request.examples->use_max ? ",max," : ",avg,") +
+                                std::to_string(request.examples->negative_weight);
+            }
+            for (int row : request.excluded_rows) {
+                examples_text += ";exclude=" + std::to_string(row);
+            }
+            if (request.fetch_count() > max_diversify_candidates) {
+                throw std::invalid_argument("topk is too large to diversify");
+            }
+            int page_size = diversify ? 0 : topk;
+            if (!cursor.empty()) {
+                request.after = Cursor::decode(cursor, metric, collection.id);
+            }
 
-            nlohmann::json response_json;
-            for (const auto& [file, score] : results) {
-                response_json["matches"].push_back({{"file", file}, {"score", score}});
+            std::string params = "collection=" + std::to_string(collection.id) + ";topk=" + std::to_string(topk) + ";mode=" + mode +
+                                 ";cursor=" + cursor + ";threshold=" + threshold_text + ";diversify=" + diversify_text +
+                                 ";examples=" + examples_text;
+            auto cache_key = QueryCache::make_key(request.examples ? request.examples->vectors.reshaped().eval() : request.embedding,
+                                                  std::move(params));
+            std::string body;
+            if (query_cache.lookup(cache_key, body)) {
+                res.set_content(body, "application/json");
+                return;
+            }
+            // Only GEMM-scored queries gain from batching; the rest go
+            // to the query pool as if batching were off.
+            if (query_batcher && QueryEngine::batchable(request)) {
+                body = query_response_json(query_batcher->submit(collection.engine, std::move(request)).get(), page_size, metric,
+                                           collection.id);
+            } else {
+                // Serialized on the query thread straight from its
+                // scratch results, so they are never copied.
+                std::promise<std::string> promise;
+                auto future = promise.get_future();
+                bool queued = query_pool.enqueue([&] {
+                    try {
+                        const QueryResults& results = engine.query(request, QueryScratch::local());
+                        promise.set_value(query_response_json(results, page_size, metric, collection.id));
+                    } catch (...) {
+                        promise.set_exception(std::current_exception());
+                    }
+                });
+                if (!queued) {
+                    throw Overloaded();
+                }
+                body = future.get();
             }
 
-            res.set_content(response_json.dump(), "application/json");
+            query_cache.insert(cache_key, body);
+            res.set_content(body, "application/json");
+        } catch (const Overloaded& e) {
+            rejected_queries++;
+            res.status = 503;
+            res.set_header("Retry-After", "1");
+            res.set_content(e.what(), "text/plain");
+        } catch (const DeadlineExceeded& e) {
+            expired_queries++;
+            res.status = 504;
+            res.set_content(e.what(), "text/plain");
+        } catch (const std::invalid_argument& e) {
+            res.status = 400;
+            res.set_content(e.what(), "text/plain");
         } catch (const std::exception& e) {
             res.status = 400;
             res.set_content("Invalid JSON", "text/plain");
         }
-    });
+    };
+
+    // Routes are registered the same way on either front end.
+    auto add_routes = [&](auto& server) {
+        server.Options(".*", [](const httplib::Request&, httplib::Response& res) {
+            enable_cors(res);
+            res.status = 200;
+        });
+
+        server.Get("/health", [](const httplib::Request&, httplib::Response& res) {
+            enable_cors(res);
+            res.set_content("OK", "text/plain");
+        });
+
+        server.Get("/get_image_info", [&](const httplib::Request& req, httplib::Response& res) {
+            enable_cors(res);
+
+            std::string file_name = req.get_param_value("file");
+            std::string file_path = image_name_to_path[file_name];
+            std::string embedding_path = image_path_to_embedding_path(file_path);
+            std::cout << "file_path: " << file_path << std::endl;
+            std::ifstream file(embedding_path);
+            if (!file.is_open()) {
+                res.status = 404;
+                res.set_content("File not found", "text/plain");
+                return;
+            }
+            nlohmann::json embedding_json;
+            file >> embedding_json;
+    
+            nlohmann::json response;
+            response["embedding"] = embedding_json;
+            response["file_path"] = file_path;
+
+            res.set_content(response.dump(), "application/json");
+        });
+
+        // Images are streamed from cached open files without being copied
+        // into the response; Range requests are sliced by the front end.
+        // `size` picks the smallest packed thumbnail at least that large and
+        // falls back to the original when there is none.
+        server.Get("/get_image", [&](const httplib::Request& req, httplib::Response& res) {
+            enable_cors(res);
+            if (!req.has_param("file")) {
+                res.status = 400;
+                res.set_content("Missing file parameter", "text/plain");
+                return;
+            }
+
+            auto send = [&](std::shared_ptr<const OpenFile> file, std::size_t offset, std::size_t length, const std::string& etag) {
+                res.set_header("ETag", etag);
+                res.set_header("Last-Modified", file->last_modified);
+                res.set_header("Cache-Control", "public, max-age=86400");
+                res.set_header("Accept-Ranges", "bytes");
+                if (OpenFile::not_modified(etag, file->mtime.tv_sec, req.get_header_value("If-None-Match"),
+                                           req.get_header_value("If-Modified-Since"))) {
+                    res.status = 304;
+                    return;
+                }
+                res.set_content_provider(length, "image/jpeg", FileContentProvider{file, offset});
+            };
+
+            std::string file_path =  req.get_param_value("file");
+            if (req.has_param("size")) {
+                int size = std::atoi(req.get_param_value("size").c_str());
+                if (size <= 0) {
+                    res.status = 400;
+                    res.set_content("Invalid size parameter", "text/plain");
+                    return;
+                }
+                if (auto thumbnail = thumbnails.find(file_path, size)) {
+                    send(thumbnail->pack, thumbnail->offset, thumbnail->length, thumbnail->etag);
+                    return;
+                }
+            }
+
+            auto file = open_files.open(file_path);
+            if (!file) {
+                res.status = 404;
+                res.set_content("File not found", "text/plain");
+                return;
+            }
+            send(file, 0, file->size, file->etag);
+        });
+
+
+        server.Get("/metrics", [&](const httplib::Request&, httplib::Response& res) {
+            enable_cors(res);
+            auto stats = query_cache.stats();
+            auto file_stats = open_files.stats();
+            std::ostringstream out;
+            out << "query_cache_hits " << stats.hits << "\n"
+                << "query_cache_misses " << stats.misses << "\n"
+                << "query_cache_hit_rate " << (stats.hits + stats.misses ? double(stats.hits) / (stats.hits + stats.misses) : 0.0) << "\n"
+                << "query_cache_evictions " << stats.evictions << "\n"
+                << "query_cache_entries " << stats.entries << "\n"
+                << "query_cache_bytes " << stats.bytes << "\n"
+                << "rejected_connections " << AdmissionTaskQueue::rejected_count().load() << "\n"
+                << "rejected_queries " << rejected_queries.load() << "\n"
+                << "expired_queries " << expired_queries.load() << "\n"
+                << "open_file_cache_hits " << file_stats.hits << "\n"
+                << "open_file_cache_misses " << file_stats.misses << "\n"
+                << "open_file_cache_entries " << file_stats.entries << "\n"
+                << "collections " << collections.list().size() << "\n"
+                << "collection_bytes " << collections.total_bytes() << "\n";
+            if (query_batcher) {
+                auto batch_stats = query_batcher->stats();
+                out << "query_batches " << batch_stats.batches << "\n"
+                    << "query_batched_queries " << batch_stats.queries << "\n";
+            }
+            res.set_content(out.str(), "text/plain");
+        });
+
+        // k-means runs as a background job: POST starts it and answers 202
+        // with the job id, GET polls its progress and, once done, returns the
+        // centroids and assignments.
+        server.Post("/cluster", [&](const httplib::Request& req, httplib::Response& res) {
+            enable_cors(res);
+            try {
+                auto json = nlohmann::json::parse(req.body);
+                KMeansOptions options;
+                options.k = json.value("k", options.k);
+                options.max_iterations = json.value("max_iterations", options.max_iterations);
+                options.seed = json.value("seed", options.seed);
+                std::string mode = json.value("mode", "cosine");
+                if (mode != "cosine" && mode != "euclidean") {
+                    throw std::invalid_argument("Clustering supports cosine and euclidean");
+                }
+                options.spherical = mode == "cosine";
+                auto engine = default_slot->load()->engine;
+                Eigen::Index rows = engine->size() - engine->deleted_rows();
+                if (options.k < 1 || options.k > rows) {
+                    throw std::invalid_argument("k must be between 1 and " + std::to_string(rows));
+                }
+                if (options.max_iterations < 1 || options.max_iterations > 1000) {
+                    throw std::invalid_argument("max_iterations must be between 1 and 1000");
+                }
+                std::string id = cluster_jobs.submit(std::move(engine), options);
+                res.status = 202;
+                res.set_content(nlohmann::json{{"job_id", id}, {"status_url", "/cluster/" + id}}.dump(), "application/json");
+            } catch (const Overloaded& e) {
+                res.status = 503;
+                res.set_header("Retry-After", "1");
+                res.set_content(e.what(), "text/plain");
+            } catch (const std::invalid_argument& e) {
+                res.status = 400;
+                res.set_content(e.what(), "text/plain");
+            } catch (const std::exception& e) {
+                res.status = 400;
+                res.set_content("Invalid JSON", "text/plain");
+            }
+        });
+
+        server.Get("/cluster/:id", [&](const httplib::Request& req, httplib::Response& res) {
+            enable_cors(res);
+            const std::string& id = req.path_params.at("id");
+            auto status = cluster_jobs.status(id);
+            if (!status) {
+                res.status = 404;
+                res.set_content("Unknown job", "text/plain");
+                return;
+            }
+            std::string body;
+            JsonWriter json(body);
+            json.raw("{\"job_id\":").string(id).raw(",\"status\":").string(status->state);
+            json.raw(",\"iteration\":").integer(status->iteration).raw(",\"max_iterations\":").integer(status->max_iterations);
+            json.raw(",\"moved\":").integer(status->moved);
+            if (!status->error.empty()) {
+                json.raw(",\"error\":").string(status->error);
+            }
+            if (status->result) {
+                json.raw(",").raw(*status->result);
+            }
+            json.raw("}");
+            res.set_content(std::move(body), "application/json");
+        });
+
+        server.Post("/query", [&](const httplib::Request& req, httplib::Response& res) {
+            handle_query(default_slot->load(), req, res);
+        });
+
+        // Named collections: PUT loads one from {"path", "mode", "index"},
+        // DELETE drops it, and /collections/{name}/query searches it like
+        // /query, defaulting to the collection's mode.
+        server.Get("/collections", [&](const httplib::Request&, httplib::Response& res) {
+            enable_cors(res);
+            nlohmann::json list = nlohmann::json::array();
+            for (const auto& collection : collections.list()) {
+                list.push_back(collection_json(*collection));
+            }
+            res.set_content(nlohmann::json{{"collections", list}, {"bytes", collections.total_bytes()}}.dump(), "application/json");
+        });
+
+        server.Get("/collections/:name", [&](const httplib::Request& req, httplib::Response& res) {
+            enable_cors(res);
+            auto collection = collections.find(req.path_params.at("name"));
+            if (!collection) {
+                res.status = 404;
+                res.set_content("Unknown collection", "text/plain");
+                return;
+            }
+            nlohmann::json json = collection_json(*collection);
+            json["reload"] = reload_json(collections.status(collection->name));
+            if (auto stats = collections.mutation_status(collection->name)) {
+                json["mutations"] = mutation_json(*stats);
+            }
+            res.set_content(json.dump(), "application/json");
+        });
+
+        // Upserts {"items": [{"file", "embedding"}, ...]} or deletes
+        // {"files": [...]}, keyed by file as reported in "matches". The reply
+        // comes once the change is logged to disk and visible to queries.
+        auto mutate = [&](const httplib::Request& req, httplib::Response& res, Mutation::Kind kind) {
+            enable_cors(res);
+            const std::string& name = req.path_params.at("name");
+            std::vector<Mutation> mutations;
+            try {
+                auto json = nlohmann::json::parse(req.body);
+                const nlohmann::json& entries = json.at(kind == Mutation::Kind::Upsert ? "items" : "files");
+                if (!entries.is_array() || entries.empty()) {
+                    throw std::invalid_argument("Nothing to change");
+                }
+                for (const auto& entry : entries) {
+                    Mutation& mutation = mutations.emplace_back();
+                    mutation.kind = kind;
+                    if (kind == Mutation::Kind::Upsert) {
+                        mutation.file = entry.at("file").get<std::string>();
+                        std::vector<float> values = entry.at("embedding").get<std::vector<float>>();
+                        mutation.embedding = Eigen::Map<const Eigen::VectorXf>(values.data(), values.size());
+                    } else {
+                        mutation.file = entry.get<std::string>();
+                    }
+                }
+                std::size_t count = mutations.size();
+                auto sequence = collections.mutate(name, std::move(mutations));
+                if (!sequence) {
+                    res.status = 404;
+                    res.set_content("Unknown collection", "text/plain");
+                    return;
+                }
+                auto collection = collections.find(name);
+                res.set_content(nlohmann::json{{"sequence", *sequence},
+                                               {"mutations", count},
+                                               {"generation", collection ? collection->generation : 0},
+                                               {"rows", collection ? collection->engine->size() - collection->engine->deleted_rows() : 0}}
+                                    .dump(),
+                                "application/json");
+            } catch (const std::invalid_argument& e) {
+                res.status = 400;
+                res.set_content(e.what(), "text/plain");
+            } catch (const nlohmann::json::exception& e) {
+                res.status = 400;
+                res.set_content("Invalid JSON", "text/plain");
+            } catch (const std::exception& e) {
+                res.status = 500;
+                res.set_content(e.what(), "text/plain");
+            }
+        };
+        server.Post("/collections/:name/upsert", [&](const httplib::Request& req, httplib::Response& res) {
+            mutate(req, res, Mutation::Kind::Upsert);
+        });
+        server.Post("/collections/:name/delete", [&](const httplib::Request& req, httplib::Response& res) {
+            mutate(req, res, Mutation::Kind::Delete);
+        });
+
+        // Loads the collection's path again in the background and swaps the
+        // new generation in once it is ready; queries keep being answered by
+        // the current one until then. Progress shows in GET "reload".
+        server.Post("/collections/:name/reload", [&](const httplib::Request& req, httplib::Response& res) {
+            enable_cors(res);
+            const std::string& name = req.path_params.at("name");
+            if (!collections.reload(name)) {
+                res.status = 404;
+                res.set_content("Unknown collection", "text/plain");
+                return;
+            }
+            res.status = 202;
+            res.set_content(nlohmann::json{{"status_url", "/collections/" + name}}.dump(), "application/json");
+        });
+
+        server.Put("/collections/:name", [&](const httplib::Request& req, httplib::Response& res) {
+            enable_cors(res);
+            try {
+                auto json = nlohmann::json::parse(req.body);
+                auto collection = collections.create(req.path_params.at("name"), json.at("path").get<std::string>(),
+                                                     parse_metric(json.value("mode", "cosine")), json.value("index", "flat"));
+                res.status = 201;
+                res.set_content(collection_json(*collection).dump(), "application/json");
+            } catch (const CollectionConflict& e) {
+                res.status = 409;
+                res.set_content(e.what(), "text/plain");
+            } catch (const CollectionBudgetExceeded& e) {
+                res.status = 507;
+                res.set_content(e.what(), "text/plain");
+            } catch (const std::invalid_argument& e) {
+                res.status = 400;
+                res.set_content(e.what(), "text/plain");
+            } catch (const std::exception& e) {
+                res.status = 400;
+                res.set_content("Invalid JSON", "text/plain");
+            }
+        });
+
+        server.Delete("/collections/:name", [&](const httplib::Request& req, httplib::Response& res) {
+            enable_cors(res);
+            try {
+                if (!collections.drop(req.path_params.at("name"))) {
+                    res.status = 404;
+                    res.set_content("Unknown collection", "text/plain");
+                    return;
+                }
+                res.status = 204;
+            } catch (const CollectionConflict& e) {
+                res.status = 409;
+                res.set_content(e.what(), "text/plain");
+            }
+        });
+
+        server.Post("/collections/:name/query", [&](const httplib::Request& req, httplib::Response& res) {
+            auto collection = collections.find(req.path_params.at("name"));
+            if (!collection) {
+                enable_cors(res);
+                res.status = 404;
+                res.set_content("Unknown collection", "text/plain");
+                return;
+            }
+            handle_query(std::move(collection), req, res);
+        });
+    };
+
+#ifdef __linux__
+    if (flags["frontend"] == "epoll") {
+        EpollServer epoll_server(flag_int(flags, "io_threads", 2), server_threads, max_queued);
+        epoll_server.set_overload_handler(overloaded);
+        add_routes(epoll_server);
+        std::cout << "Server started on http://0.0.0.0:8765 (epoll)\n";
+        epoll_server.listen("0.0.0.0", 8765);
+        query_pool.shutdown();
+        return 0;
+    }
+#endif
 
+    add_routes(svr);
     std::cout << "Server started on http://0.0.0.0:8765\n";
     svr.listen("0.0.0.0", 8765);
+    query_pool.shutdown();
 
     return 0;
 }
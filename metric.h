@@ -0,0 +1,228 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#include "corpus.h"
+
+// Distance / similarity modes accepted by the "mode" field of /query.
+enum class Metric { Cosine, Euclidean, Dot, L1 };
+constexpr int kNumMetrics = 4;
+
+inline Metric parse_metric(const std::string& mode) {
+    if (mode == "cosine") return Metric::Cosine;
+    if (mode == "euclidean") return Metric::Euclidean;
+    if (mode == "dot") return Metric::Dot;
+    if (mode == "l1") return Metric::L1;
+    throw std::invalid_argument("Invalid mode: " + mode);
+}
+
+inline const char* metric_name(Metric metric) {
+    switch (metric) {
+        case Metric::Cosine: return "cosine";
+        case Metric::Euclidean: return "euclidean";
+        case Metric::Dot: return "dot";
+        case Metric::L1: return "l1";
+    }
+    return "";
+}
+
+// Per-row statistics computed once when the corpus is loaded so that the
+// scan never has to renormalize the corpus.
+struct RowStats {
+    Eigen::VectorXf inv_norms;   // 1 / ||x||, 0 for all-zero rows
+    Eigen::VectorXf sq_norms;    // ||x||^2
+
+    static RowStats compute(const Corpus& corpus) {
+        RowStats stats;
+        stats.sq_norms = corpus.matrix().rowwise().squaredNorm();
+        stats.inv_norms = stats.sq_norms.unaryExpr([](float s) { return s > 0.0f ? 1.0f / std::sqrt(s) : 0.0f; });
+        return stats;
+    }
+};
+
+// Corpus and query views with a compile-time column count. Dim is the padded
+// row stride: one of the sizes instantiated in scan_kernel_for() or
+// Eigen::Dynamic. Queries passed to the kernels are padded to the same width.
+template <int Dim>
+using CorpusView = Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Dim, Eigen::RowMajor>, Eigen::Aligned64>;
+template <int Dim>
+using QueryView = Eigen::Map<const Eigen::Matrix<float, Dim, 1>>;
+using ScoresView = Eigen::Map<Eigen::VectorXf>;
+
+// Rows [begin, begin + rows) of the corpus.
+template <int Dim>
+CorpusView<Dim> corpus_view(const Corpus& corpus, Eigen::Index begin, Eigen::Index rows) {
+    return CorpusView<Dim>(corpus.row(begin), rows, corpus.stride());
+}
+
+template <int Dim>
+QueryView<Dim> query_view(const Eigen::VectorXf& query) {
+    return QueryView<Dim>(query.data(), query.size());
+}
+
+// Metric policies. `prepare_query` maps the padded query in place, once per
+// request; `scan` then fills `scores` for the corpus rows starting at `begin`
+// (one value per element of `scores`), so callers can scan in blocks. Each policy
+// says whether larger is better, and `finalize` maps the ranking score to
+// the value reported to clients; it is only applied to the selected top-k.
+// `rank_bound` is the inverse, for thresholds given in reported units.
+// Metrics with `supports_gemm` can also be scored from a precomputed x.q
+// (see QueryEngine::query_batch) through `from_dot`.
+struct CosineMetric {
+    static constexpr Metric kind = Metric::Cosine;
+    static constexpr bool higher_is_better = true;
+
+    static void prepare_query(Eigen::Ref<Eigen::VectorXf> query) { query.normalize(); }
+
+    template <int Dim>
+    static void scan(const Corpus& embeddings, const RowStats& stats, const Eigen::VectorXf& query, Eigen::Index begin, ScoresView scores) {
+        scores.noalias() = corpus_view<Dim>(embeddings, begin, scores.size()) * query_view<Dim>(query);
+        scores.array() *= stats.inv_norms.segment(begin, scores.size()).array();
+    }
+    static float finalize(float score) { return score; }
+    static float rank_bound(float score) { return score; }
+
+    static constexpr bool supports_gemm = true;
+    static float from_dot(float dot, const RowStats& stats, Eigen::Index row, float) { return dot * stats.inv_norms(row); }
+};
+
+struct DotMetric {
+    static constexpr Metric kind = Metric::Dot;
+    static constexpr bool higher_is_better = true;
+
+    static void prepare_query(Eigen::Ref<Eigen::VectorXf>) {}
+
+    template <int Dim>
+    static void scan(const Corpus& embeddings, const RowStats&, const Eigen::VectorXf& query, Eigen::Index begin, ScoresView scores) {
+        scores.noalias() = corpus_view<Dim>(embeddings, begin, scores.size()) * query_view<Dim>(query);
+    }
+    static float finalize(float score) { return score; }
+    static float rank_bound(float score) { return score; }
+
+    static constexpr bool supports_gemm = true;
+    static float from_dot(float dot, const RowStats&, Eigen::Index, float) { return dot; }
+};
+
+// Ranks by squared distance expanded as ||x||^2 - 2 x.q + ||q||^2 so the
+// scan is a single GEMV; the square root is taken only for reported hits.
+struct EuclideanMetric {
+    static constexpr Metric kind = Metric::Euclidean;
+    static constexpr bool higher_is_better = false;
+
+    static void prepare_query(Eigen::Ref<Eigen::VectorXf>) {}
+
+    template <int Dim>
+    static void scan(const Corpus& embeddings, const RowStats& stats, const Eigen::VectorXf& query, Eigen::Index begin, ScoresView scores) {
+        scores.noalias() = corpus_view<Dim>(embeddings, begin, scores.size()) * query_view<Dim>(query);
+        scores = (stats.sq_norms.segment(begin, scores.size()).array() - 2.0f * scores.array() + query.squaredNorm()).max(0.0f);
+    }
+    static float finalize(float score) { return std::sqrt(score); }
+    static float rank_bound(float radius) { return radius < 0 ? -1.0f : radius * radius; }
+
+    static constexpr bool supports_gemm = true;
+    static float from_dot(float dot, const RowStats& stats, Eigen::Index row, float query_sq_norm) {
+        return std::max(0.0f, stats.sq_norms(row) - 2.0f * dot + query_sq_norm);
+    }
+};
+
+struct L1Metric {
+    static constexpr Metric kind = Metric::L1;
+    static constexpr bool higher_is_better = false;
+
+    static void prepare_query(Eigen::Ref<Eigen::VectorXf>) {}
+
+    template <int Dim>
+    static void scan(const Corpus& embeddings, const RowStats&, const Eigen::VectorXf& query, Eigen::Index begin, ScoresView scores) {
+        // A per-row reduction over contiguous aligned rows vectorizes far
+        // better than Eigen's rowwise() partial reduction of an expression.
+        auto q = query_view<Dim>(query);
+        for (Eigen::Index i = 0; i < scores.size(); ++i) {
+            Eigen::Map<const Eigen::Matrix<float, Dim, 1>, Eigen::Aligned64> row(embeddings.row(begin + i), embeddings.stride());
+            scores(i) = (row - q).cwiseAbs().sum();
+        }
+    }
+    static float finalize(float score) { return score; }
+    static float rank_bound(float score) { return score; }
+
+    static constexpr bool supports_gemm = false;
+};
+
+using ScanKernel = void (*)(const Corpus&, const RowStats&, const Eigen::VectorXf&, Eigen::Index, ScoresView);
+
+// Picks the scan instantiation for the corpus row stride. The common model
+// sizes are already multiples of the row padding and get a fixed inner
+// dimension so Eigen fully unrolls the per-row dot product; anything else
+// uses the dynamic kernel.
+template <typename MetricPolicy>
+ScanKernel scan_kernel_for(Eigen::Index dim) {
+    switch (dim) {
+        case 384: return &MetricPolicy::template scan<384>;
+        case 512: return &MetricPolicy::template scan<512>;
+        case 768: return &MetricPolicy::template scan<768>;
+        case 1024: return &MetricPolicy::template scan<1024>;
+        case 1280: return &MetricPolicy::template scan<1280>;
+        default: return &MetricPolicy::template scan<Eigen::Dynamic>;
+    }
+}
+
+// Calls `fn` with a default-constructed policy object for `metric`, so callers
+// branch on the mode once per query and the scan itself is fully static.
+template <typename Fn>
+decltype(auto) dispatch_metric(Metric metric, Fn&& fn) {
+    switch (metric) {
+        case Metric::Cosine: return fn(CosineMetric{});
+        case Metric::Euclidean: return fn(EuclideanMetric{});
+        case Metric::Dot: return fn(DotMetric{});
+        case Metric::L1: return fn(L1Metric{});
+    }
+    throw std::invalid_argument("Invalid metric");
+}
+
+// MIPS -> L2 reduction (Bachrach et al.): append sqrt(M^2 - ||x||^2) to every
+// row, where M is the largest row norm, and 0 to the query. Nearest neighbours
+// under euclidean distance in the augmented space are then exactly the
+// maximum inner product rows, which lets L2-only graph indexes serve "dot".
+inline Corpus mips_to_l2(const Corpus& embeddings) {
+    Eigen::VectorXf sq_norms(embeddings.rows());
+    for (Eigen::Index i = 0; i < embeddings.rows(); ++i) {
+        sq_norms(i) = Eigen::Map<const Eigen::VectorXf>(embeddings.row(i), embeddings.dim()).squaredNorm();
+    }
+    float max_sq_norm = sq_norms.size() > 0 ? sq_norms.maxCoeff() : 0.0f;
+
+    Corpus augmented(embeddings.rows(), embeddings.dim() + 1);
+    for (Eigen::Index i = 0; i < embeddings.rows(); ++i) {
+        float* row = augmented.row(i);
+        std::copy_n(embeddings.row(i), embeddings.dim(), row);
+        row[embeddings.dim()] = std::sqrt(std::max(0.0f, max_sq_norm - sq_norms(i)));
+        std::fill(row + embeddings.dim() + 1, row + augmented.stride(), 0.0f);
+    }
+    return augmented;
+}
+
+inline Eigen::VectorXf mips_query_to_l2(const Eigen::VectorXf& query) {
+    Eigen::VectorXf augmented(query.size() + 1);
+    augmented.head(query.size()) = query;
+    augmented(query.size()) = 0.0f;
+    return augmented;
+}
+
+// One scan kernel per metric, resolved once for a given corpus row stride.
+struct ScanKernels {
+    ScanKernel kernels[kNumMetrics];
+
+    static ScanKernels for_stride(Eigen::Index dim) {
+        ScanKernels table{};
+        table.kernels[static_cast<int>(Metric::Cosine)] = scan_kernel_for<CosineMetric>(dim);
+        table.kernels[static_cast<int>(Metric::Euclidean)] = scan_kernel_for<EuclideanMetric>(dim);
+        table.kernels[static_cast<int>(Metric::Dot)] = scan_kernel_for<DotMetric>(dim);
+        table.kernels[static_cast<int>(Metric::L1)] = scan_kernel_for<L1Metric>(dim);
+        return table;
+    }
+
+    template <typename MetricPolicy>
+    ScanKernel get() const { return kernels[static_cast<int>(MetricPolicy::kind)]; }
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "metric.h"
+#include "query_engine.h"
+
+// Most examples one multi-vector /query may carry.
+constexpr std::size_t kMaxQueryExamples = 256;
+
+// One entry of "positive" or "negative": an embedding, or the file path of a
+// corpus image as reported in "matches", which is looked up in the engine
+// and its row added to `rows`.
+inline Eigen::VectorXf example_embedding(const QueryEngine& engine, const nlohmann::json& entry, std::vector<int>& rows) {
+    if (entry.is_string()) {
+        std::string path = entry.get<std::string>();
+        auto row = engine.find_row(path);
+        if (!row) {
+            throw std::invalid_argument("Unknown file: " + path);
+        }
+        rows.push_back(static_cast<int>(*row));
+        return Eigen::Map<const Eigen::VectorXf>(engine.row(*row).data, engine.dim());
+    }
+    std::vector<float> values = entry.get<std::vector<float>>();
+    if (static_cast<Eigen::Index>(values.size()) != engine.dim()) {
+        throw std::invalid_argument("Embedding size mismatch");
+    }
+    return Eigen::Map<const Eigen::VectorXf>(values.data(), values.size());
+}
+
+// Fills `request` from the "positive", "negative", "combine" and
+// "negative_weight" fields of a /query body, for "more like these, less like
+// those" searches in one pass over the corpus:
+//   centroid  (default) a single query vector, the mean of the positives
+//             minus negative_weight times the mean of the negatives; under
+//             cosine every example is scaled to unit length first
+//   max, avg  every example is scored in one GEMM per row tile and a row
+//             scores the max or mean over the positives minus negative_weight
+//             times that over the negatives (cosine and dot only)
+// Examples given as corpus paths are left out of the results; otherwise a
+// positive one would come back as the top hit.
+inline void parse_examples(const QueryEngine& engine, const nlohmann::json& body, QueryRequest& request) {
+    const nlohmann::json none = nlohmann::json::array();
+    const nlohmann::json& positive = body.contains("positive") ? body["positive"] : none;
+    const nlohmann::json& negative = body.contains("negative") ? body["negative"] : none;
+    if (!positive.is_array() || !negative.is_array()) {
+        throw std::invalid_argument("positive and negative must be arrays");
+    }
+    std::size_t count = positive.size() + negative.size();
+    if (count == 0 || count > kMaxQueryExamples) {
+        throw std::invalid_argument("A query needs between 1 and " + std::to_string(kMaxQueryExamples) + " examples");
+    }
+    float negative_weight = body.value("negative_weight", 1.0f);
+    std::string combine = body.value("combine", "centroid");
+
+    Eigen::MatrixXf vectors(engine.dim(), count);
+    for (std::size_t i = 0; i < count; ++i) {
+        const nlohmann::json& entry = i < positive.size() ? positive[i] : negative[i - positive.size()];
+        vectors.col(i) = example_embedding(engine, entry, request.excluded_rows);
+    }
+    std::sort(request.excluded_rows.begin(), request.excluded_rows.end());
+    request.excluded_rows.erase(std::unique(request.excluded_rows.begin(), request.excluded_rows.end()), request.excluded_rows.end());
+    const Eigen::Index positives = positive.size();
+
+    if (combine == "centroid") {
+        if (request.metric == Metric::Cosine) {
+            for (Eigen::Index c = 0; c < vectors.cols(); ++c) {
+                float norm = vectors.col(c).norm();
+                if (norm > 0.0f) {
+                    vectors.col(c) /= norm;
+                }
+            }
+        }
+        request.embedding = Eigen::VectorXf::Zero(engine.dim());
+        if (positives > 0) {
+            request.embedding += vectors.leftCols(positives).rowwise().mean();
+        }
+        if (positives < vectors.cols()) {
+            request.embedding -= negative_weight * vectors.rightCols(vectors.cols() - positives).rowwise().mean();
+        }
+    } else if (combine == "max" || combine == "avg") {
+        if (request.metric != Metric::Cosine && request.metric != Metric::Dot) {
+            throw std::invalid_argument("combine " + combine + " supports cosine and dot");
+        }
+        QueryRequest::Examples& examples = request.examples.emplace();
+        examples.vectors = std::move(vectors);
+        examples.positives = positives;
+        examples.use_max = combine == "max";
+        examples.negative_weight = negative_weight;
+    } else {
+        throw std::invalid_argument("Invalid combine: " + combine);
+    }
+}
@@ -0,0 +1,354 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "file_cache.h"
+#include "string_table.h"
+#include "wal.h"
+
+// The durable mutations of one collection, kept in `directory`:
+//   wal         upserts and deletes since the last checkpoint (see wal.h)
+//   checkpoint  the net effect of everything up to a sequence number,
+//               "MUTCKPT2", sequence (u64), the files as a StringTable
+//               (the layout of the .paths files), then per file in that
+//               order kind (u8), dimension (u32), floats
+// Together they form an overlay over the collection's source files: the
+// latest upsert or delete of every file touched so far. Opening a store
+// recovers that overlay from the checkpoint and the log after it.
+//
+// commit() hands mutations to one writer thread, which takes everything
+// queued since its last round as a group, appends it to the log with a
+// single fdatasync, passes it to `apply` (which publishes it to queries) and
+// only then wakes the committers: a mutation is acknowledged once it is both
+// durable and visible. A group that is logged but fails to apply is still
+// acknowledged, since it survives a restart, and the failure is logged.
+// Once the log outgrows `checkpoint_bytes`, or `checkpoint_interval` passes
+// with anything logged, the writer saves a checkpoint (written aside,
+// synced and renamed over the old one) and empties the log, which bounds
+// both disk use and recovery time.
+class MutationStore {
+public:
+    using Apply = std::function<void(const std::vector<Mutation>&)>;
+
+    struct Options {
+        std::string directory = "data";  // one subdirectory per collection
+        std::size_t checkpoint_bytes = std::size_t(64) << 20;
+        std::chrono::seconds checkpoint_interval = std::chrono::seconds(300);
+    };
+
+    struct Stats {
+        std::uint64_t sequence = 0;             // of the last committed mutation
+        std::uint64_t checkpoint_sequence = 0;  // covered by the checkpoint
+        std::size_t wal_bytes = 0;
+        std::size_t files = 0;  // in the overlay
+        std::uint64_t mutations = 0;
+        std::uint64_t group_commits = 0;
+        std::uint64_t checkpoints = 0;
+        std::size_t recovered = 0;  // overlay files read back at open
+        std::size_t replayed = 0;   // log records after the checkpoint
+        double recovery_ms = 0;
+    };
+
+    MutationStore(std::string directory, const Options& options)
+        : directory(std::move(directory)), options(options) {
+        std::filesystem::create_directories(this->directory);
+        auto start = std::chrono::steady_clock::now();
+        read_checkpoint();
+        auto records = WriteAheadLog::replay(wal_path(), checkpoint_sequence);
+        for (auto& [sequence, mutation] : records) {
+            sequence_ = sequence;
+            set(std::move(mutation));
+        }
+        stats.replayed = records.size();
+        stats.recovered = overlay.size();
+        stats.recovery_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        wal = std::make_unique<WriteAheadLog>(wal_path());
+        stats.wal_bytes = wal->bytes();
+        last_checkpoint = std::chrono::steady_clock::now();
+    }
+
+    MutationStore(const MutationStore&) = delete;
+    MutationStore& operator=(const MutationStore&) = delete;
+
+    // Commits what is still queued, then stops the writer.
+    ~MutationStore() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shutdown = true;
+        }
+        cv.notify_all();
+        if (writer.joinable()) {
+            writer.join();
+        }
+    }
+
+    // Starts the writer; `apply` is called on it once per group.
+    void start(Apply apply) {
+        this->apply = std::move(apply);
+        writer = std::thread([this] { write_loop(); });
+    }
+
+    // Blocks until `mutations` are logged and applied; returns the sequence
+    // number of the last one.
+    std::uint64_t commit(std::vector<Mutation> mutations) {
+        Pending pending{std::move(mutations), {}};
+        std::future<std::uint64_t> done = pending.done.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(std::move(pending));
+        }
+        cv.notify_all();
+        return done.get();
+    }
+
+    // The latest mutation of every file touched so far, to be replayed over
+    // a fresh load of the collection's source files.
+    std::vector<Mutation> overlay_mutations() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<Mutation> mutations;
+        mutations.reserve(overlay.size());
+        for (const auto& [file, mutation] : overlay) {
+            mutations.push_back(mutation);
+        }
+        return mutations;
+    }
+
+    Stats status() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats result = stats;
+        result.sequence = sequence_;
+        result.checkpoint_sequence = checkpoint_sequence;
+        result.files = overlay.size();
+        return result;
+    }
+
+private:
+    struct Pending {
+        std::vector<Mutation> mutations;
+        std::promise<std::uint64_t> done;
+    };
+
+    static constexpr char kCheckpointMagic[8] = {'M', 'U', 'T', 'C', 'K', 'P', 'T', '2'};
+
+    std::string directory;
+    Options options;
+    Apply apply;
+    std::unique_ptr<WriteAheadLog> wal;  // written by the writer thread only
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Pending> queue;
+    std::map<std::string, Mutation> overlay;
+    std::uint64_t sequence_ = 0;
+    std::uint64_t checkpoint_sequence = 0;
+    Stats stats;
+    std::chrono::steady_clock::time_point last_checkpoint;
+    bool shutdown = false;
+    std::thread writer;
+
+    std::string wal_path() const { return directory + "/wal"; }
+    std::string checkpoint_path() const { return directory + "/checkpoint"; }
+
+    // Callers hold `mutex` or run before the writer starts.
+    void set(Mutation mutation) {
+        std::string file = mutation.file;
+        overlay[file] = std::move(mutation);
+    }
+
+    void write_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            cv.wait_for(lock, options.checkpoint_interval, [&] { return shutdown || !queue.empty(); });
+            if (queue.empty()) {
+                if (shutdown) {
+                    return;
+                }
+                if (sequence_ > checkpoint_sequence && std::chrono::steady_clock::now() - last_checkpoint >= options.checkpoint_interval) {
+                    checkpoint(lock);
+                }
+                continue;
+            }
+            std::vector<Pending> group = std::move(queue);
+            queue.clear();
+            std::uint64_t first = sequence_ + 1;
+            lock.unlock();
+
+            std::vector<Mutation> mutations;
+            for (Pending& pending : group) {
+                for (Mutation& mutation : pending.mutations) {
+                    mutations.push_back(std::move(mutation));
+                }
+            }
+            std::exception_ptr error;
+            try {
+                wal->append(mutations, first);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            if (!error) {
+                // The overlay changes before the group is applied, so a reload
+                // in between already includes it; applying it again is harmless.
+                lock.lock();
+                for (const Mutation& mutation : mutations) {
+                    set(mutation);
+                }
+                sequence_ = first + mutations.size() - 1;
+                stats.mutations += mutations.size();
+                stats.group_commits++;
+                stats.wal_bytes = wal->bytes();
+                lock.unlock();
+                // The group is durable and in the overlay, so it is committed
+                // even if publishing it fails; queries then miss it until the
+                // collection is next reloaded.
+                try {
+                    apply(mutations);
+                } catch (const std::exception& e) {
+                    std::cerr << "Applying mutations " << first << ".." << first + mutations.size() - 1 << " of " << directory
+                              << " failed: " << e.what() << "\n";
+                }
+            }
+
+            std::uint64_t sequence = first;
+            for (Pending& pending : group) {
+                sequence += pending.mutations.size();
+                if (error) {
+                    pending.done.set_exception(error);
+                } else {
+                    pending.done.set_value(sequence - 1);
+                }
+            }
+
+            lock.lock();
+            if (!error && stats.wal_bytes >= options.checkpoint_bytes) {
+                checkpoint(lock);
+            }
+        }
+    }
+
+    // Saves the overlay as of the current sequence number and empties the
+    // log. Runs on the writer with `lock` held on entry and exit; the files
+    // are written without it.
+    void checkpoint(std::unique_lock<std::mutex>& lock) {
+        std::uint64_t sequence = sequence_;
+        std::string out(kCheckpointMagic, sizeof(kCheckpointMagic));
+        auto put = [&](auto value) { out.append(reinterpret_cast<const char*>(&value), sizeof(value)); };
+        put(sequence);
+        StringTable files;
+        for (const auto& [file, mutation] : overlay) {
+            files.push_back(file);
+        }
+        files.serialize(out);
+        for (const auto& [file, mutation] : overlay) {
+            put(static_cast<std::uint8_t>(mutation.kind));
+            put(static_cast<std::uint32_t>(mutation.embedding.size()));
+            out.append(reinterpret_cast<const char*>(mutation.embedding.data()), mutation.embedding.size() * sizeof(float));
+        }
+        lock.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+        try {
+            write_durably(checkpoint_path(), out);
+            wal->clear();
+        } catch (const std::exception& e) {
+            std::cerr << "Checkpoint of " << directory << " failed: " << e.what() << "\n";
+            lock.lock();
+            last_checkpoint = std::chrono::steady_clock::now();
+            return;
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Checkpoint of " << directory << " at " << sequence << ": " << out.size() << " bytes in " << ms << " ms\n";
+
+        lock.lock();
+        checkpoint_sequence = sequence;
+        stats.wal_bytes = 0;
+        last_checkpoint = std::chrono::steady_clock::now();
+        stats.checkpoints++;
+    }
+
+    void read_checkpoint() {
+        auto file = OpenFile::open(checkpoint_path());
+        if (!file) {
+            return;
+        }
+        std::size_t offset = 0;
+        auto get = [&](void* value, std::size_t size) {
+            if (size > file->size - offset) {
+                throw std::runtime_error("Truncated checkpoint: " + checkpoint_path());
+            }
+            std::memcpy(value, file->data + offset, size);
+            offset += size;
+        };
+        char magic[sizeof(kCheckpointMagic)];
+        get(magic, sizeof(magic));
+        if (std::memcmp(magic, kCheckpointMagic, sizeof(magic)) != 0) {
+            throw std::runtime_error("Not a checkpoint: " + checkpoint_path());
+        }
+        get(&checkpoint_sequence, sizeof(checkpoint_sequence));
+        StringTable files = StringTable::map(file, offset, checkpoint_path());
+        for (std::size_t i = 0; i < files.size(); ++i) {
+            Mutation mutation;
+            std::uint8_t kind;
+            std::uint32_t dim;
+            get(&kind, sizeof(kind));
+            mutation.kind = static_cast<Mutation::Kind>(kind);
+            mutation.file = files[i];
+            get(&dim, sizeof(dim));
+            if (dim > (file->size - offset) / sizeof(float)) {
+                throw std::runtime_error("Truncated checkpoint: " + checkpoint_path());
+            }
+            mutation.embedding.resize(dim);
+            get(mutation.embedding.data(), dim * sizeof(float));
+            set(std::move(mutation));
+        }
+        sequence_ = checkpoint_sequence;
+    }
+
+    // Replaces `path` with `contents` so that a crash leaves either the old
+    // or the new file: written aside, synced, renamed over, directory synced.
+    static void write_durably(const std::string& path, const std::string& contents) {
+        std::string temporary = path + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "Could not open " + temporary);
+        }
+        for (std::size_t written = 0; written < contents.size();) {
+            ssize_t n = ::write(fd, contents.data() + written, contents.size() - written);
+            if (n < 0 && errno != EINTR) {
+                ::close(fd);
+                throw std::system_error(errno, std::generic_category(), "Could not write " + temporary);
+            }
+            written += n > 0 ? n : 0;
+        }
+        if (::fsync(fd) != 0 || ::close(fd) != 0) {
+            throw std::system_error(errno, std::generic_category(), "Could not sync " + temporary);
+        }
+        if (::rename(temporary.c_str(), path.c_str()) != 0) {
+            throw std::system_error(errno, std::generic_category(), "Could not rename " + temporary);
+        }
+        std::string parent = std::filesystem::path(path).parent_path().string();
+        int dir = ::open(parent.empty() ? "." : parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir >= 0) {
+            ::fsync(dir);
+            ::close(dir);
+        }
+    }
+};
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+// CPU sets of the memory partitions the corpus is sharded over. Normally one
+// partition per NUMA node; simulate_partitions() splits a single node into
+// several so the sharded path can be exercised on one-socket machines.
+struct NumaTopology {
+    struct Partition {
+        int node = 0;
+        std::vector<int> cpus;
+    };
+    std::vector<Partition> partitions;
+};
+
+// Parses sysfs cpulist syntax, e.g. "0-3,8-11".
+inline std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        auto dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+inline NumaTopology detect_numa_topology() {
+    NumaTopology topology;
+#ifdef HAVE_LIBNUMA
+    if (numa_available() >= 0) {
+        struct bitmask* mask = numa_allocate_cpumask();
+        for (int node = 0; node <= numa_max_node(); ++node) {
+            if (numa_node_to_cpus(node, mask) != 0) {
+                continue;
+            }
+            NumaTopology::Partition partition{node, {}};
+            for (unsigned cpu = 0; cpu < mask->size; ++cpu) {
+                if (numa_bitmask_isbitset(mask, cpu)) {
+                    partition.cpus.push_back(cpu);
+                }
+            }
+            if (!partition.cpus.empty()) {
+                topology.partitions.push_back(partition);
+            }
+        }
+        numa_free_cpumask(mask);
+    }
+#elif defined(__linux__)
+    for (int node = 0;; ++node) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!file.is_open()) {
+            break;
+        }
+        std::string list;
+        std::getline(file, list);
+        NumaTopology::Partition partition{node, parse_cpu_list(list)};
+        if (!partition.cpus.empty()) {
+            topology.partitions.push_back(partition);
+        }
+    }
+#endif
+    if (topology.partitions.empty()) {
+        NumaTopology::Partition partition;
+        for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) {
+            partition.cpus.push_back(cpu);
+        }
+        topology.partitions.push_back(partition);
+    }
+    return topology;
+}
+
+// Splits the CPUs of `topology` round-robin into `count` partitions, keeping
+// each CPU's real node. CPUs are reused when there are fewer than `count`.
+inline NumaTopology simulate_partitions(const NumaTopology& topology, int count) {
+    std::vector<std::pair<int, int>> cpus;  // (node, cpu)
+    for (const auto& partition : topology.partitions) {
+        for (int cpu : partition.cpus) {
+            cpus.emplace_back(partition.node, cpu);
+        }
+    }
+
+    NumaTopology simulated;
+    simulated.partitions.resize(count);
+    for (int p = 0; p < count; ++p) {
+        simulated.partitions[p].node = cpus[p % cpus.size()].first;
+    }
+    for (std::size_t i = 0; i < std::max<std::size_t>(cpus.size(), count); ++i) {
+        simulated.partitions[i % count].cpus.push_back(cpus[i % cpus.size()].second);
+    }
+    return simulated;
+}
+
+// Restricts the calling thread to the partition's CPUs and, with libnuma,
+// prefers its node for new pages, so memory it touches first is node-local.
+inline void pin_to_partition(const NumaTopology::Partition& partition) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : partition.cpus) {
+        CPU_SET(cpu, &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+#ifdef HAVE_LIBNUMA
+    if (numa_available() >= 0) {
+        numa_set_preferred(partition.node);
+    }
+#endif
+}
+
+// Runs `fn(p)` on a new thread pinned to partition p, for every partition,
+// and waits for all of them.
+inline void run_pinned(const NumaTopology& topology, const std::function<void(int)>& fn) {
+    std::vector<std::thread> threads;
+    for (int p = 0; p < static_cast<int>(topology.partitions.size()); ++p) {
+        threads.emplace_back([&, p] {
+            pin_to_partition(topology.partitions[p]);
+            fn(p);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Long-lived scan workers, one per CPU of each partition and pinned to it.
+// Each partition has its own task queue so work submitted for a shard only
+// ever runs on cores next to that shard's memory.
+class PartitionWorkers {
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<bool> shutdown{false};
+
+    void worker_loop(Queue& queue) {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(queue.mutex);
+                queue.cv.wait(lock, [&] { return shutdown || !queue.tasks.empty(); });
+                if (queue.tasks.empty()) {
+                    return;
+                }
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    explicit PartitionWorkers(const NumaTopology& topology) {
+        for (std::size_t p = 0; p < topology.partitions.size(); ++p) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (std::size_t p = 0; p < topology.partitions.size(); ++p) {
+            for (std::size_t i = 0; i < topology.partitions[p].cpus.size(); ++i) {
+                threads.emplace_back([this, partition = topology.partitions[p], &queue = *queues[p]] {
+                    pin_to_partition(partition);
+                    worker_loop(queue);
+                });
+            }
+        }
+    }
+
+    PartitionWorkers(const PartitionWorkers&) = delete;
+    PartitionWorkers& operator=(const PartitionWorkers&) = delete;
+
+    ~PartitionWorkers() {
+        shutdown = true;
+        for (auto& queue : queues) {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->cv.notify_all();
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    std::size_t size() const { return queues.size(); }
+
+    // Runs `fn(p)` on a worker of every partition p and blocks until all
+    // partitions have finished.
+    void run_on_all(const std::function<void(int)>& fn) {
+        std::vector<std::future<void>> pending;
+        for (std::size_t p = 0; p < queues.size(); ++p) {
+            auto task = std::make_shared<std::packaged_task<void()>>([&fn, p] { fn(static_cast<int>(p)); });
+            pending.push_back(task->get_future());
+            {
+                std::lock_guard<std::mutex> lock(queues[p]->mutex);
+                queues[p]->tasks.emplace_back([task] { (*task)(); });
+            }
+            queues[p]->cv.notify_one();
+        }
+        // Wait for every partition before rethrowing, since the tasks
+        // reference the caller's stack.
+        std::exception_ptr error;
+        for (auto& future : pending) {
+            try {
+                future.get();
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// Large zeroed allocations for corpus storage. On Linux, buffers of at least
+// one huge page are first requested from the explicit 2 MB hugetlb pool
+// (MAP_HUGETLB), then as a 2 MB aligned anonymous mapping advised for
+// transparent huge pages; everything else, and every other platform, falls
+// back to aligned_alloc.
+enum class PageBacking { Heap, Transparent, Explicit };
+
+inline const char* page_backing_name(PageBacking backing) {
+    switch (backing) {
+        case PageBacking::Heap: return "heap";
+        case PageBacking::Transparent: return "transparent huge pages";
+        case PageBacking::Explicit: return "explicit huge pages";
+    }
+    return "unknown";
+}
+
+struct PageAllocation {
+    void* data = nullptr;
+    std::size_t bytes = 0;
+    void* mapping = nullptr;      // base of the mmap region, if any
+    std::size_t mapping_bytes = 0;
+    PageBacking backing = PageBacking::Heap;
+};
+
+constexpr std::size_t kHugePageSize = 2 * 1024 * 1024;
+
+// Set to false to force heap allocations, e.g. when comparing backings.
+inline bool& huge_pages_enabled() {
+    static bool enabled = true;
+    return enabled;
+}
+
+inline PageAllocation allocate_pages(std::size_t bytes, std::size_t alignment) {
+    PageAllocation allocation;
+    allocation.bytes = bytes;
+    if (bytes == 0) {
+        return allocation;
+    }
+
+#ifdef __linux__
+    if (huge_pages_enabled() && bytes >= kHugePageSize) {
+        std::size_t rounded = (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+
+        void* p = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            allocation.data = allocation.mapping = p;
+            allocation.mapping_bytes = rounded;
+            allocation.backing = PageBacking::Explicit;
+            return allocation;
+        }
+
+        // Over-map by one huge page so the usable range can start on a 2 MB
+        // boundary; khugepaged and the fault path only use huge pages for
+        // aligned extents.
+        std::size_t mapping_bytes = rounded + kHugePageSize;
+        p = mmap(nullptr, mapping_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            auto base = reinterpret_cast<std::uintptr_t>(p);
+            auto aligned = (base + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+            allocation.data = reinterpret_cast<void*>(aligned);
+            allocation.mapping = p;
+            allocation.mapping_bytes = mapping_bytes;
+            allocation.backing = PageBacking::Transparent;
+            madvise(allocation.data, rounded, MADV_HUGEPAGE);
+            // Touch now so the pages are faulted in (as huge pages when the
+            // kernel can) at load time rather than on the first query.
+            std::memset(allocation.data, 0, bytes);
+            return allocation;
+        }
+    }
+#endif
+
+    std::size_t rounded = (bytes + alignment - 1) / alignment * alignment;
+    allocation.data = std::aligned_alloc(alignment, rounded);
+    if (!allocation.data) {
+        throw std::bad_alloc();
+    }
+    std::memset(allocation.data, 0, rounded);
+    return allocation;
+}
+
+inline void free_pages(PageAllocation& allocation) {
+#ifdef __linux__
+    if (allocation.mapping) {
+        munmap(allocation.mapping, allocation.mapping_bytes);
+        allocation = PageAllocation{};
+        return;
+    }
+#endif
+    std::free(allocation.data);
+    allocation = PageAllocation{};
+}
+
+// Bytes of `allocation` currently backed by huge pages. Explicit mappings are
+// huge by construction; for THP the AnonHugePages of the containing VMA is
+// read from /proc/self/smaps.
+inline std::size_t huge_page_bytes(const PageAllocation& allocation) {
+    if (allocation.backing == PageBacking::Explicit) {
+        return allocation.bytes;
+    }
+    if (allocation.backing != PageBacking::Transparent) {
+        return 0;
+    }
+
+    std::ifstream smaps("/proc/self/smaps");
+    auto address = reinterpret_cast<std::uintptr_t>(allocation.data);
+    std::string line;
+    bool in_region = false;
+    while (std::getline(smaps, line)) {
+        std::uintptr_t start = 0, end = 0;
+        char dash = 0;
+        std::istringstream header(line);
+        if (header >> std::hex >> start >> dash >> end && dash == '-') {
+            in_region = start <= address && address < end;
+            continue;
+        }
+        if (in_region && line.rfind("AnonHugePages:", 0) == 0) {
+            std::size_t kb = 0;
+            std::istringstream(line.substr(14)) >> kb;
+            return std::min(kb * 1024, allocation.bytes);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// Runs fn(i) for i in [0, n) on `threads` threads, handing out chunks of
+// `chunk` indices.
+template <typename Fn>
+void parallel_for(std::size_t n, int threads, std::size_t chunk, Fn&& fn) {
+    std::atomic<std::size_t> next{0};
+    auto work = [&] {
+        for (std::size_t begin = next.fetch_add(chunk); begin < n; begin = next.fetch_add(chunk)) {
+            for (std::size_t i = begin; i < std::min(n, begin + chunk); ++i) {
+                fn(i);
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; ++t) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
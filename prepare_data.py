@@ -1,5 +1,6 @@
 import shutil
 import glob
+import io
 import json
 import os
 import shutil
@@ -17,6 +18,7 @@ import uuid
 import requests
 
 DATA_DIR = "animals10/raw-img"
+THUMBNAIL_DIR = "animals10/thumbnails"
 
 def test_server(file_path):
     url = "http://0.0.0.0:8765/query"
@@ -91,9 +93,28 @@ def prepare_image_name_to_path():
     return image_name_to_path
 
 
+def prepare_thumbnails(size=150, quality=85):
+    """Pack downsized JPEGs into THUMBNAIL_DIR/<size>.pack with an index of [offset, length] per image path."""
+    os.makedirs(THUMBNAIL_DIR, exist_ok=True)
+    index = {}
+    with open(os.path.join(THUMBNAIL_DIR, f"{size}.pack"), "wb") as pack:
+        for file_path in tqdm(sorted(glob.glob(f"{DATA_DIR}/*/*.jpg"))):
+            with Image.open(file_path) as img:
+                img = img.convert("RGB")
+                img.thumbnail((size, size))
+                buffer = io.BytesIO()
+                img.save(buffer, "JPEG", quality=quality)
+            data = buffer.getvalue()
+            index[file_path] = [pack.tell(), len(data)]
+            pack.write(data)
+    with open(os.path.join(THUMBNAIL_DIR, f"{size}.index.json"), "w") as f:
+        json.dump(index, f)
+
+
 def main():
     convert_images_to_jpg()
     prepare_image_name_to_path()
+    prepare_thumbnails()
     torch.hub.set_dir(os.getcwd())  # Sets cache directory for models
     device = "cuda" if torch.cuda.is_available() else "cpu"
     print(f"Using device: {device}")
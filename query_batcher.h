@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "admission.h"
+#include "query_engine.h"
+
+// Coalesces concurrent /query requests into micro-batches. Handler threads
+// submit() and block on the returned future; dispatcher threads wait until
+// either `max_batch` requests are queued or `window` has passed since the
+// oldest one arrived, then answer the whole batch with one
+// QueryEngine::query_batch call, i.e. one pass over the corpus instead of one
+// per request. The window bounds the latency added to any single request,
+// and at most `max_queued` requests may wait (0 = unbounded); beyond that
+// submit() throws Overloaded. Every request names the engine (collection
+// generation) it runs on and keeps it alive until answered; a batch that
+// spans engines runs one query_batch per engine. Only requests for which
+// QueryEngine::batchable holds belong here: the rest would run one by one
+// on the dispatcher and hold up every batch behind them, so callers send
+// them to the query pool instead.
+class QueryBatcher {
+public:
+    using Results = QueryResults;
+
+    struct Stats {
+        std::uint64_t batches = 0;
+        std::uint64_t queries = 0;
+    };
+
+    QueryBatcher(std::size_t max_batch, std::chrono::microseconds window, std::size_t dispatchers = 1, std::size_t max_queued = 0)
+        : max_batch(max_batch), window(window), max_queued(max_queued) {
+        for (std::size_t i = 0; i < dispatchers; ++i) {
+            threads.emplace_back([this] { dispatch_loop(); });
+        }
+    }
+
+    QueryBatcher(const QueryBatcher&) = delete;
+    QueryBatcher& operator=(const QueryBatcher&) = delete;
+
+    ~QueryBatcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shutdown = true;
+        }
+        cv.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    std::future<Results> submit(std::shared_ptr<const QueryEngine> engine, QueryRequest request) {
+        if (!request.examples && request.embedding.size() != engine->dim()) {
+            throw std::invalid_argument("Embedding size mismatch");
+        }
+        Pending pending{std::move(engine), std::move(request), {}, std::chrono::steady_clock::now()};
+        auto future = pending.promise.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (max_queued > 0 && queue.size() >= max_queued) {
+                throw Overloaded();
+            }
+            queue.push_back(std::move(pending));
+        }
+        cv.notify_one();
+        return future;
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats_;
+    }
+
+private:
+    struct Pending {
+        std::shared_ptr<const QueryEngine> engine;
+        QueryRequest request;
+        std::promise<Results> promise;
+        std::chrono::steady_clock::time_point arrived;
+    };
+
+    std::size_t max_batch;
+    std::chrono::microseconds window;
+    std::size_t max_queued;
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Pending> queue;
+    bool shutdown = false;
+    Stats stats_;
+    std::vector<std::thread> threads;
+
+    void dispatch_loop() {
+        for (;;) {
+            std::vector<Pending> batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return shutdown || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                auto deadline = queue.front().arrived + window;
+                cv.wait_until(lock, deadline, [&] { return shutdown || queue.size() >= max_batch; });
+
+                std::size_t take = std::min(max_batch, queue.size());
+                for (std::size_t i = 0; i < take; ++i) {
+                    batch.push_back(std::move(queue.front()));
+                    queue.pop_front();
+                }
+                if (!batch.empty()) {
+                    stats_.batches++;
+                    stats_.queries += batch.size();
+                }
+            }
+            if (batch.empty()) {
+                continue;
+            }
+
+            std::stable_sort(batch.begin(), batch.end(), [](const Pending& a, const Pending& b) { return a.engine < b.engine; });
+            for (auto group = batch.begin(); group != batch.end();) {
+                auto group_end = std::find_if(group, batch.end(), [&](const Pending& p) { return p.engine != group->engine; });
+                run_batch(group, group_end);
+                group = group_end;
+            }
+        }
+    }
+
+    void run_batch(std::vector<Pending>::iterator begin, std::vector<Pending>::iterator end) {
+        std::vector<QueryRequest> requests;
+        for (auto it = begin; it != end; ++it) {
+            requests.push_back(std::move(it->request));
+        }
+        try {
+            auto answers = begin->engine->query_batch(requests);
+            for (std::size_t i = 0; i < requests.size(); ++i) {
+                if (answers[i].error) {
+                    begin[i].promise.set_exception(answers[i].error);
+                } else {
+                    begin[i].promise.set_value(std::move(answers[i].results));
+                }
+            }
+        } catch (...) {
+            for (auto it = begin; it != end; ++it) {
+                it->promise.set_exception(std::current_exception());
+            }
+        }
+    }
+};
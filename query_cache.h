@@ -0,0 +1,165 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Cache of serialized /query responses. Keys combine the query embedding,
+// quantized so that float noise from JSON round trips still hits, with a
+// canonical string of every other parameter that affects the result (topk,
+// mode, ...). The cache is split into independently locked LRU shards so
+// httplib worker threads rarely contend, and each shard enforces its share of
+// the byte budget plus a per-entry TTL. There is no invalidation: keys carry
+// the id of the collection generation they were computed on, so a reload or
+// mutation, which publishes a new generation, simply stops hitting the old
+// entries, and those age out through the LRU and the TTL.
+class QueryCache {
+public:
+    struct Key {
+        std::vector<std::int32_t> quantized;
+        std::string params;
+        std::size_t hash = 0;
+
+        bool operator==(const Key& other) const {
+            return hash == other.hash && params == other.params && quantized == other.quantized;
+        }
+    };
+
+    struct Stats {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t evictions = 0;
+        std::uint64_t entries = 0;
+        std::uint64_t bytes = 0;
+    };
+
+    static constexpr float kQuantizationScale = 4096.0f;
+
+    QueryCache(std::size_t capacity_bytes, std::chrono::seconds ttl, std::size_t num_shards = 16)
+        : shard_capacity(capacity_bytes / num_shards), ttl(ttl), shards(num_shards) {
+        for (auto& shard : shards) {
+            shard = std::make_unique<Shard>();
+        }
+    }
+
+    bool enabled() const { return shard_capacity > 0; }
+
+    static Key make_key(const Eigen::VectorXf& embedding, std::string params) {
+        Key key;
+        key.params = std::move(params);
+        key.quantized.resize(embedding.size());
+        std::size_t hash = std::hash<std::string>()(key.params);
+        for (Eigen::Index i = 0; i < embedding.size(); ++i) {
+            key.quantized[i] = static_cast<std::int32_t>(std::lround(embedding(i) * kQuantizationScale));
+            hash ^= std::hash<std::int32_t>()(key.quantized[i]) + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+        }
+        key.hash = hash;
+        return key;
+    }
+
+    bool lookup(const Key& key, std::string& value) {
+        if (!enabled()) {
+            return false;
+        }
+        Shard& shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end() || std::chrono::steady_clock::now() - it->second->inserted > ttl) {
+            if (it != shard.index.end()) {
+                shard.erase(it->second);
+            }
+            misses++;
+            return false;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        value = it->second->value;
+        hits++;
+        return true;
+    }
+
+    void insert(const Key& key, const std::string& value) {
+        if (!enabled()) {
+            return;
+        }
+        std::size_t size = entry_bytes(key, value);
+        if (size > shard_capacity) {
+            return;
+        }
+
+        Shard& shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            shard.erase(it->second);
+        }
+        while (shard.bytes + size > shard_capacity && !shard.lru.empty()) {
+            shard.erase(std::prev(shard.lru.end()));
+            evictions++;
+        }
+        shard.lru.push_front(Entry{key, value, size, std::chrono::steady_clock::now()});
+        shard.index.emplace(key, shard.lru.begin());
+        shard.bytes += size;
+    }
+
+    Stats stats() const {
+        Stats stats;
+        stats.hits = hits.load();
+        stats.misses = misses.load();
+        stats.evictions = evictions.load();
+        for (const auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            stats.entries += shard->lru.size();
+            stats.bytes += shard->bytes;
+        }
+        return stats;
+    }
+
+private:
+    struct Entry {
+        Key key;
+        std::string value;
+        std::size_t bytes;
+        std::chrono::steady_clock::time_point inserted;
+    };
+
+    struct KeyHash {
+        std::size_t operator()(const Key& key) const { return key.hash; }
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::list<Entry> lru;
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+        std::size_t bytes = 0;
+
+        void erase(std::list<Entry>::iterator entry) {
+            bytes -= entry->bytes;
+            index.erase(entry->key);
+            lru.erase(entry);
+        }
+    };
+
+    std::size_t shard_capacity;
+    std::chrono::seconds ttl;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<std::uint64_t> hits{0};
+    std::atomic<std::uint64_t> misses{0};
+    std::atomic<std::uint64_t> evictions{0};
+
+    Shard& shard_for(const Key& key) { return *shards[(key.hash >> 7) % shards.size()]; }
+
+    static std::size_t entry_bytes(const Key& key, const std::string& value) {
+        // The key is held by both the LRU entry and the index.
+        return 2 * (sizeof(Key) + key.quantized.size() * sizeof(std::int32_t) + key.params.size()) +
+               sizeof(Entry) + value.size();
+    }
+};
@@ -0,0 +1,870 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "corpus.h"
+#include "metric.h"
+#include "numa_topology.h"
+#include "string_table.h"
+#include "topk.h"
+
+namespace fs = std::filesystem;
+
+inline std::string embedding_path_to_image_path(const std::string& embedding_path) {
+    std::string image_path = embedding_path;
+    return image_path.replace(image_path.find("embedding"), 9, "raw-img").replace(image_path.find(".json"), 5, ".jpg");
+}
+
+inline std::string image_path_to_embedding_path(const std::string& image_path) {
+    std::string embedding_path = image_path;
+    return embedding_path.replace(embedding_path.find("raw-img"), 7, "embedding").replace(embedding_path.find(".jpg"), 4, ".json");
+}
+
+inline std::vector<fs::path> list_embedding_files(const std::string& directory) {
+    std::vector<fs::path> paths;
+    for (const auto& entry : fs::recursive_directory_iterator(directory)) {
+        if (entry.path().extension() == ".json") {
+            paths.push_back(entry.path());
+        }
+    }
+    return paths;
+}
+
+inline bool read_embedding_file(const fs::path& path, std::vector<float>& embedding) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Warning: Could not open file: " << path << "\n";
+        return false;
+    }
+
+    try {
+        nlohmann::json j;
+        file >> j;
+        j.get_to(embedding);
+        return true;
+    } catch (const std::exception& e) {
+        std::cerr << "Error parsing file " << path << ": " << e.what() << "\n";
+        return false;
+    }
+}
+
+// Reads the given embedding files straight into a Corpus sized for all of
+// them, along with the image path of every row. With dim < 0 the dimension
+// comes from the first file that parses. The corpus is first touched by the
+// calling thread.
+inline std::pair<Corpus, StringTable> load_embedding_files(const std::vector<fs::path>& paths, Eigen::Index dim = -1) {
+    Corpus embeddings;
+    StringTable image_paths;
+    std::vector<float> embedding;
+
+    for (const auto& path : paths) {
+        if (!read_embedding_file(path, embedding)) {
+            continue;
+        }
+
+        if (dim < 0) {
+            dim = embedding.size();
+        }
+        if (static_cast<Eigen::Index>(embedding.size()) != dim) {
+            std::cerr << "Skipping " << path << " due to size mismatch.\n";
+            continue;
+        }
+        if (embeddings.rows() == 0) {
+            embeddings = Corpus(paths.size(), dim);
+        }
+
+        std::copy(embedding.begin(), embedding.end(), embeddings.row(image_paths.size()));
+        image_paths.push_back(embedding_path_to_image_path(path.string()));
+    }
+
+    embeddings.truncate(image_paths.size());
+    return {std::move(embeddings), std::move(image_paths)};
+}
+
+inline std::pair<Corpus, StringTable> load_embeddings(const std::string& directory) {
+    return load_embedding_files(list_embedding_files(directory));
+}
+
+// Splits the embedding files into one contiguous shard per partition. Each
+// shard is allocated and filled by a thread pinned to its partition, so its
+// pages are first touched, and therefore placed, on that partition's node.
+inline std::vector<std::pair<Corpus, StringTable>> load_embeddings_sharded(const std::string& directory, const NumaTopology& topology) {
+    std::vector<fs::path> paths = list_embedding_files(directory);
+
+    Eigen::Index dim = -1;
+    std::vector<float> embedding;
+    for (const auto& path : paths) {
+        if (read_embedding_file(path, embedding)) {
+            dim = embedding.size();
+            break;
+        }
+    }
+
+    std::size_t partitions = topology.partitions.size();
+    std::vector<std::pair<Corpus, StringTable>> shards(partitions);
+    run_pinned(topology, [&](int p) {
+        std::size_t begin = paths.size() * p / partitions;
+        std::size_t end = paths.size() * (p + 1) / partitions;
+        shards[p] = load_embedding_files(std::vector<fs::path>(paths.begin() + begin, paths.begin() + end), dim);
+    });
+    return shards;
+}
+
+// Point in time after which a query is abandoned. Scans check it between
+// row blocks, so a query overruns its deadline by at most one block.
+using Deadline = std::chrono::steady_clock::time_point;
+constexpr Deadline kNoDeadline = Deadline::max();
+
+struct DeadlineExceeded : std::runtime_error {
+    DeadlineExceeded() : std::runtime_error("Query deadline exceeded") {}
+};
+
+// One ranked hit. `file` is a view into the engine's path table and stays
+// valid for as long as the engine does; `score` is what clients see and
+// `rank_score` the metric's internal ranking value it was finalized from.
+struct Match {
+    std::string_view file;
+    float score = 0;
+    int row = 0;
+    float rank_score = 0;
+};
+
+// Matches, best first.
+using QueryResults = std::vector<Match>;
+
+// Resume point for paging through a ranked list: the ranking score and
+// global row of the last match already returned. A query given a cursor only
+// ranks rows that come strictly after it, so each page keeps just topk
+// candidates instead of rescanning with an ever larger topk. Encoded for
+// clients as an opaque hex token that also pins the metric and the
+// generation it was issued for: global rows are renumbered when a reload or
+// a merge builds the next generation, so a cursor of another one would skip
+// or repeat matches.
+struct Cursor {
+    float rank_score = 0;
+    int row = 0;
+
+    static Cursor after(const Match& match) { return {match.rank_score, match.row}; }
+
+    std::string encode(Metric metric, std::uint64_t generation) const {
+        unsigned char bytes[kBytes];
+        bytes[0] = static_cast<unsigned char>(metric);
+        std::memcpy(bytes + 1, &generation, 8);
+        std::memcpy(bytes + 9, &rank_score, 4);
+        std::memcpy(bytes + 13, &row, 4);
+        static const char* hex = "0123456789abcdef";
+        std::string token;
+        for (unsigned char byte : bytes) {
+            token.push_back(hex[byte >> 4]);
+            token.push_back(hex[byte & 15]);
+        }
+        return token;
+    }
+
+    // Throws std::invalid_argument for a malformed token or one issued for
+    // another metric or generation.
+    static Cursor decode(const std::string& token, Metric metric, std::uint64_t generation) {
+        unsigned char bytes[kBytes];
+        if (token.size() != 2 * sizeof(bytes)) {
+            throw std::invalid_argument("Invalid cursor");
+        }
+        for (std::size_t i = 0; i < sizeof(bytes); ++i) {
+            int value = 0;
+            for (char c : {token[2 * i], token[2 * i + 1]}) {
+                int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+                if (digit < 0) {
+                    throw std::invalid_argument("Invalid cursor");
+                }
+                value = value * 16 + digit;
+            }
+            bytes[i] = static_cast<unsigned char>(value);
+        }
+        if (bytes[0] != static_cast<unsigned char>(metric)) {
+            throw std::invalid_argument("Cursor was issued for another mode");
+        }
+        std::uint64_t issued;
+        std::memcpy(&issued, bytes + 1, 8);
+        if (issued != generation) {
+            throw std::invalid_argument("Stale cursor: the collection changed since it was issued");
+        }
+        Cursor cursor;
+        std::memcpy(&cursor.rank_score, bytes + 9, 4);
+        std::memcpy(&cursor.row, bytes + 13, 4);
+        return cursor;
+    }
+
+    static constexpr std::size_t kBytes = 17;  // metric, generation, rank_score, row
+};
+
+// Per-thread working memory for running queries: the padded query, a score
+// block, the top-k heaps and the results. Buffers only grow, so once a thread
+// has answered its largest query it answers the next ones without touching
+// the heap. Everything is overwritten by the next query on the same scratch.
+struct QueryScratch {
+    Eigen::VectorXf query;
+    Eigen::VectorXf scores;
+    std::vector<std::pair<float, int>> heap;
+    std::vector<std::vector<std::pair<float, int>>> partials;  // one heap per shard
+    QueryResults results;
+
+    // Diversified reranking (see QueryEngine::diversify); only grown.
+    Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> candidates;
+    Eigen::VectorXf relevance;
+    Eigen::VectorXf redundancy;
+    Eigen::VectorXf similarities;
+    std::vector<char> picked;
+    std::vector<std::pair<float, int>> reranked;
+
+    // Multi-vector queries: the padded examples and one tile of their scores.
+    Eigen::MatrixXf examples;
+    Eigen::MatrixXf example_scores;
+
+    static QueryScratch& local() {
+        thread_local QueryScratch scratch;
+        return scratch;
+    }
+};
+
+// One query of a batch handed to QueryEngine::query_batch.
+struct QueryRequest {
+    Eigen::VectorXf embedding;
+    int topk = 5;
+    Metric metric = Metric::Cosine;
+    Deadline deadline = kNoDeadline;
+    std::optional<Cursor> after;
+    // Range search: only rows whose reported score is at least this
+    // (similarities) or at most this (distances); topk then caps the page.
+    std::optional<float> threshold;
+    // Global rows never returned, sorted: the examples of a multi-vector
+    // query given as corpus paths, which the client already has.
+    std::vector<int> excluded_rows;
+
+    // Maximal marginal relevance: the scan keeps `candidates` rows (5 x topk
+    // when 0) and topk of them are picked trading relevance to the query
+    // against similarity to the picks so far, weighted by `lambda`.
+    struct Diversify {
+        float lambda = 0.5f;
+        int candidates = 0;
+    };
+    std::optional<Diversify> diversify;
+
+    // Rows the scan keeps: topk, or the candidate pool when diversifying.
+    int fetch_count() const {
+        if (!diversify) {
+            return topk;
+        }
+        return std::max(topk, diversify->candidates > 0 ? diversify->candidates : 5 * topk);
+    }
+
+    // Multi-vector query: instead of against `embedding`, rows are scored
+    // against every column of `vectors` and a row's score is
+    //   aggregate(first `positives` columns) - negative_weight * aggregate(rest)
+    // with aggregate the max or the mean. Similarity metrics only.
+    struct Examples {
+        Eigen::MatrixXf vectors;  // dim x examples
+        int positives = 0;
+        bool use_max = false;
+        float negative_weight = 1.0f;
+    };
+    std::optional<Examples> examples;
+};
+
+// One answer of QueryEngine::query_batch: the results, or the exception
+// that request alone raised (DeadlineExceeded, std::invalid_argument, ...).
+struct BatchAnswer {
+    QueryResults results;
+    std::exception_ptr error;
+};
+
+// The rows a request lets into its heap: those ranked after its cursor and
+// within its threshold. Checked before the heap, so a row that fails costs
+// one comparison.
+template <typename Metric>
+struct RowFilter {
+    bool has_after = false;
+    std::pair<float, int> after{0.0f, 0};
+    bool has_bound = false;
+    float bound = 0;
+    const std::vector<int>* excluded = nullptr;
+
+    explicit RowFilter(const QueryRequest& request) {
+        if (request.after) {
+            has_after = true;
+            after = {request.after->rank_score, request.after->row};
+        }
+        if (request.threshold) {
+            has_bound = true;
+            bound = Metric::rank_bound(*request.threshold);
+        }
+        if (!request.excluded_rows.empty()) {
+            excluded = &request.excluded_rows;
+        }
+    }
+
+    bool active() const { return has_after || has_bound || excluded; }
+
+    bool admits(const std::pair<float, int>& candidate) const {
+        return (!has_after || topk_better<Metric>(after, candidate)) && (!has_bound || within_bound<Metric>(candidate.first, bound)) &&
+               (!excluded || !std::binary_search(excluded->begin(), excluded->end(), candidate.second));
+    }
+};
+
+// An immutable run of corpus rows with what the engine precomputes for them:
+// the row statistics the scan kernels read and a lookup of rows by path.
+// Both are built with the segment, so engines built one from another after
+// mutations (see segments.h) share every segment they have in common and
+// never rebuild them on the query path.
+struct Segment {
+    Corpus embeddings;
+    RowStats row_stats;
+    StringTable image_paths;
+    std::unordered_map<std::string_view, Eigen::Index> rows_by_path;  // views into image_paths
+    bool sealed = true;  // false for a memtable, which the next rows replace
+    int partition = -1;  // NUMA partition whose memory holds it, if loaded into one
+
+    Segment(Corpus corpus, StringTable paths, bool sealed = true, int partition = -1)
+        : embeddings(std::move(corpus)), image_paths(std::move(paths)), sealed(sealed), partition(partition) {
+        row_stats = RowStats::compute(embeddings);
+        rows_by_path.reserve(image_paths.size());
+        for (std::size_t row = 0; row < image_paths.size(); ++row) {
+            rows_by_path.emplace(image_paths[row], row);
+        }
+    }
+
+    Segment(const Segment&) = delete;
+    Segment& operator=(const Segment&) = delete;
+
+    Eigen::Index rows() const { return embeddings.rows(); }
+};
+
+class QueryEngine {
+public:
+    // A segment placed at global row `offset`, with the rows deleted from it
+    // since it was built.
+    struct Shard {
+        std::shared_ptr<const Segment> segment;
+        std::shared_ptr<const std::vector<char>> deleted;  // per row; null if none
+        Eigen::Index deleted_rows = 0;
+        Eigen::Index offset = 0;
+
+        const Corpus& embeddings() const { return segment->embeddings; }
+        const RowStats& row_stats() const { return segment->row_stats; }
+        bool is_deleted(Eigen::Index row) const { return deleted && (*deleted)[row]; }
+    };
+
+private:
+    std::vector<Shard> shards;
+    Eigen::Index total_rows = 0;
+    Eigen::Index deleted_count = 0;
+    Eigen::Index dimension = 0;
+    ScanKernels scan_kernels;
+    std::shared_ptr<PartitionWorkers> workers;  // set when sharded over partitions
+
+    // Rows scored per kernel call. The score block stays cache resident
+    // between the kernel and the top-k pass, and the deadline is checked
+    // once per block.
+    static constexpr Eigen::Index kScanBlockRows = 16384;
+
+    // Scores are written to the scanning thread's own scratch block, which
+    // may not be the caller's when the shard is scanned by a partition worker.
+    // `examples` holds the prepared columns of a multi-vector request.
+    template <typename Metric>
+    void scan_shard(const Shard& shard, const Eigen::VectorXf& query_embedding, const Eigen::MatrixXf& examples,
+                    const QueryRequest& request, std::vector<std::pair<float, int>>& heap) const {
+        RowFilter<Metric> filter(request);
+        bool filtered = filter.active() || shard.deleted;
+        heap.clear();
+        Eigen::VectorXf& scores = QueryScratch::local().scores;
+        if (scores.size() < kScanBlockRows) {
+            scores.resize(kScanBlockRows);
+        }
+        ScanKernel kernel = scan_kernels.get<Metric>();
+
+        for (Eigen::Index begin = 0; begin < shard.embeddings().rows(); begin += kScanBlockRows) {
+            if (request.deadline != kNoDeadline && std::chrono::steady_clock::now() > request.deadline) {
+                throw DeadlineExceeded();
+            }
+            Eigen::Index rows = std::min(kScanBlockRows, shard.embeddings().rows() - begin);
+            if (request.examples) {
+                score_examples<Metric>(shard, examples, *request.examples, begin, ScoresView(scores.data(), rows));
+            } else {
+                kernel(shard.embeddings(), shard.row_stats(), query_embedding, begin, ScoresView(scores.data(), rows));
+            }
+            for (Eigen::Index r = 0; r < rows; ++r) {
+                std::pair<float, int> candidate(scores(r), shard.offset + begin + r);
+                if (filtered && (shard.is_deleted(begin + r) || !filter.admits(candidate))) {
+                    continue;
+                }
+                push_topk<Metric>(heap, request.fetch_count(), candidate.first, candidate.second);
+            }
+        }
+
+        finish_topk<Metric>(heap);
+    }
+
+    // Runs the query padded into `scratch.query` (or `scratch.examples`) and
+    // leaves the top-k ranking scores, best first, in `scratch.heap`.
+    template <typename Metric>
+    void query_impl(QueryScratch& scratch, const QueryRequest& request) const {
+        if (request.examples) {
+            for (Eigen::Index c = 0; c < scratch.examples.cols(); ++c) {
+                Metric::prepare_query(scratch.examples.col(c));
+            }
+        } else {
+            Metric::prepare_query(scratch.query);
+        }
+
+        if (!workers && shards.size() == 1) {
+            scan_shard<Metric>(shards.front(), scratch.query, scratch.examples, request, scratch.heap);
+        } else {
+            scratch.partials.resize(shards.size());
+            for_each_shard([&](std::size_t s) {
+                scan_shard<Metric>(shards[s], scratch.query, scratch.examples, request, scratch.partials[s]);
+            });
+            merge_topk<Metric>(scratch.partials, request.fetch_count(), scratch.heap);
+        }
+    }
+
+    // Calls `scan(s)` for every shard s. Without partition workers segments
+    // are scanned one after another on the calling thread. With them, every
+    // partition scans the shards loaded into its memory on its own cores, so
+    // only per-shard top-k lists cross the interconnect; segments built
+    // after loading (memtables, merges) are dealt round-robin.
+    template <typename Scan>
+    void for_each_shard(const Scan& scan) const {
+        if (!workers) {
+            for (std::size_t s = 0; s < shards.size(); ++s) {
+                scan(s);
+            }
+            return;
+        }
+        std::size_t partitions = workers->size();
+        workers->run_on_all([&](int p) {
+            for (std::size_t s = 0; s < shards.size(); ++s) {
+                int partition = shards[s].segment->partition;
+                std::size_t owner = partition >= 0 ? static_cast<std::size_t>(partition) : s % partitions;
+                if (owner == static_cast<std::size_t>(p)) {
+                    scan(s);
+                }
+            }
+        });
+    }
+
+    // Rows of a shard multiplied per GEMM of a multi-vector query.
+    static constexpr Eigen::Index kExampleTileRows = 256;
+
+    // Scores shard rows [begin, begin + scores.size()) for a multi-vector
+    // query: each tile of rows is multiplied with all example columns in one
+    // GEMM, so the corpus is read once however many examples there are, and
+    // each row's positive and negative scores are then aggregated.
+    template <typename Metric>
+    void score_examples(const Shard& shard, const Eigen::MatrixXf& examples, const QueryRequest::Examples& options,
+                        Eigen::Index begin, ScoresView scores) const {
+        if constexpr (Metric::supports_gemm && Metric::higher_is_better) {
+            const Eigen::Index columns = examples.cols();
+            Eigen::MatrixXf& tile = QueryScratch::local().example_scores;
+            if (tile.rows() < kExampleTileRows || tile.cols() != columns) {
+                tile.resize(kExampleTileRows, columns);
+            }
+            auto aggregate = [&](Eigen::Index r, Eigen::Index row, Eigen::Index from, Eigen::Index to) {
+                float result = options.use_max ? std::numeric_limits<float>::lowest() : 0.0f;
+                for (Eigen::Index c = from; c < to; ++c) {
+                    float score = Metric::from_dot(tile(r, c), shard.row_stats(), row, 0.0f);
+                    result = options.use_max ? std::max(result, score) : result + score;
+                }
+                return options.use_max ? result : result / static_cast<float>(to - from);
+            };
+
+            for (Eigen::Index t = 0; t < scores.size(); t += kExampleTileRows) {
+                Eigen::Index rows = std::min(kExampleTileRows, scores.size() - t);
+                Corpus::MatrixView block(shard.embeddings().row(begin + t), rows, shard.embeddings().stride());
+                tile.topRows(rows).noalias() = block * examples;
+                for (Eigen::Index r = 0; r < rows; ++r) {
+                    Eigen::Index row = begin + t + r;
+                    float score = options.positives > 0 ? aggregate(r, row, 0, options.positives) : 0.0f;
+                    if (options.positives < columns) {
+                        score -= options.negative_weight * aggregate(r, row, options.positives, columns);
+                    }
+                    scores(t + r) = score;
+                }
+            }
+        } else {
+            throw std::invalid_argument("Multi-vector scoring supports cosine and dot");
+        }
+    }
+
+    // Rows of a shard multiplied per GEMM in query_batch; bounds the score
+    // block to kBatchBlockRows x batch floats.
+    static constexpr Eigen::Index kBatchBlockRows = 4096;
+
+    // Scores every query column of `gemm_queries` against one shard, one row
+    // block at a time, feeding each column into its own top-k heap. Queries
+    // whose deadline passes are flagged in `expired` and no longer scored.
+    void scan_shard_batch(const Shard& shard, const Eigen::MatrixXf& gemm_queries, const std::vector<const QueryRequest*>& requests,
+                          const Eigen::VectorXf& query_sq_norms, std::vector<std::vector<std::pair<float, int>>>& heaps,
+                          std::vector<char>& expired) const {
+        const Corpus& corpus = shard.embeddings();
+        Eigen::MatrixXf block_scores;
+        for (Eigen::Index begin = 0; begin < corpus.rows(); begin += kBatchBlockRows) {
+            Eigen::Index rows = std::min(kBatchBlockRows, corpus.rows() - begin);
+            Corpus::MatrixView block(corpus.row(begin), rows, corpus.stride());
+            block_scores.noalias() = block * gemm_queries;
+
+            auto now = std::chrono::steady_clock::now();
+            for (std::size_t j = 0; j < requests.size(); ++j) {
+                if (expired[j] || now > requests[j]->deadline) {
+                    expired[j] = true;
+                    continue;
+                }
+                dispatch_metric(requests[j]->metric, [&](auto metric) {
+                    using Metric = decltype(metric);
+                    if constexpr (Metric::supports_gemm) {
+                        RowFilter<Metric> filter(*requests[j]);
+                        for (Eigen::Index r = 0; r < rows; ++r) {
+                            std::pair<float, int> candidate(
+                                Metric::from_dot(block_scores(r, j), shard.row_stats(), begin + r, query_sq_norms(j)),
+                                shard.offset + begin + r);
+                            if (shard.is_deleted(begin + r) || !filter.admits(candidate)) {
+                                continue;
+                            }
+                            push_topk<Metric>(heaps[j], requests[j]->topk, candidate.first, candidate.second);
+                        }
+                    }
+                });
+            }
+        }
+    }
+
+    template <typename Metric>
+    void to_results(const std::vector<std::pair<float, int>>& topk_indices, QueryResults& results) const {
+        results.clear();
+        for (const auto& [value, idx] : topk_indices) {
+            results.push_back({image_path(idx), Metric::finalize(value), idx, value});
+        }
+    }
+
+    // Maximal marginal relevance over the candidates in scratch.heap (best
+    // first): picks, one at a time, the candidate maximizing
+    //   lambda * relevance(x) - (1 - lambda) * max cos(x, p) over the picks p
+    // and leaves the first topk picks in scratch.heap in pick order, with
+    // their scan scores. Relevance is the scan score rescaled to [0, 1] over
+    // the candidates, best = 1, so any metric works and lambda = 1 keeps the
+    // plain order. The candidates are gathered unit length into one small
+    // matrix and each pick updates the redundancy of all of them with one
+    // GEMV; the corpus is not rescanned.
+    void diversify(QueryScratch& scratch, int topk, float lambda) const {
+        const Eigen::Index n = scratch.heap.size();
+        const Eigen::Index padded = stride();
+        if (scratch.candidates.rows() < n || scratch.candidates.cols() != padded) {
+            scratch.candidates.resize(n, padded);
+        }
+        if (n == 0) {
+            return;
+        }
+        for (Eigen::VectorXf* v : {&scratch.relevance, &scratch.redundancy, &scratch.similarities}) {
+            if (v->size() < n) {
+                v->resize(n);
+            }
+        }
+        auto candidates = scratch.candidates.topRows(n);
+        auto relevance = scratch.relevance.head(n);
+        auto redundancy = scratch.redundancy.head(n);
+        auto similarities = scratch.similarities.head(n);
+
+        for (Eigen::Index i = 0; i < n; ++i) {
+            RowRef candidate = row(scratch.heap[i].second);
+            candidates.row(i) = Eigen::Map<const Eigen::RowVectorXf>(candidate.data, padded) * candidate.inv_norm;
+            relevance(i) = scratch.heap[i].first;
+        }
+        float best_value = scratch.heap.front().first, worst_value = scratch.heap.back().first;
+        if (best_value != worst_value) {
+            relevance = (relevance.array() - worst_value) / (best_value - worst_value);
+        } else {
+            relevance.setOnes();
+        }
+        redundancy.setConstant(std::numeric_limits<float>::lowest());
+        scratch.picked.assign(n, false);
+        scratch.reranked.clear();
+
+        const Eigen::Index picks = std::min<Eigen::Index>(topk, n);
+        for (Eigen::Index p = 0; p < picks; ++p) {
+            Eigen::Index best = -1;
+            float best_score = 0.0f;
+            for (Eigen::Index i = 0; i < n; ++i) {
+                if (scratch.picked[i]) {
+                    continue;
+                }
+                float score = lambda * relevance(i) - (p == 0 ? 0.0f : (1.0f - lambda) * redundancy(i));
+                if (best < 0 || score > best_score) {
+                    best = i;
+                    best_score = score;
+                }
+            }
+            scratch.picked[best] = true;
+            scratch.reranked.push_back(scratch.heap[best]);
+            if (p + 1 < picks) {
+                similarities.noalias() = candidates * candidates.row(best).transpose();
+                redundancy = redundancy.cwiseMax(similarities);
+            }
+        }
+        std::swap(scratch.heap, scratch.reranked);
+    }
+
+    // Pads every example column like pad_query, reusing `padded` when it
+    // already has the size.
+    void pad_examples(const Eigen::MatrixXf& examples, Eigen::MatrixXf& padded) const {
+        if (examples.rows() != dimension) {
+            throw std::invalid_argument("Embedding size mismatch");
+        }
+        padded.resize(Corpus::padded_dim(dimension), examples.cols());
+        padded.topRows(dimension) = examples;
+        padded.bottomRows(padded.rows() - dimension).setZero();
+    }
+
+    // Reuses `padded_query` when it already has the padded size.
+    void pad_query(const Eigen::VectorXf& query_embedding, Eigen::VectorXf& padded_query) const {
+        if (query_embedding.size() != dimension) {
+            throw std::invalid_argument("Embedding size mismatch");
+        }
+        padded_query.resize(Corpus::padded_dim(dimension));
+        padded_query.head(dimension) = query_embedding;
+        padded_query.tail(padded_query.size() - dimension).setZero();
+    }
+
+public:
+    QueryEngine(Corpus embeddings, StringTable image_paths) {
+        std::vector<std::pair<Corpus, StringTable>> single;
+        single.emplace_back(std::move(embeddings), std::move(image_paths));
+        init(std::move(single));
+    }
+
+    // Sharded engine: shard p must have been loaded by a thread pinned to
+    // partition p of `topology` (see load_embeddings_sharded).
+    QueryEngine(std::vector<std::pair<Corpus, StringTable>> sharded, const NumaTopology& topology) {
+        init(std::move(sharded), true);
+        workers = std::make_shared<PartitionWorkers>(topology);
+    }
+
+    // Segmented engine over shared segments (offsets are reassigned). An
+    // engine derived from a sharded one passes on its partition_workers(),
+    // which keep scanning each partition's segments on that partition.
+    explicit QueryEngine(std::vector<Shard> segments, std::shared_ptr<PartitionWorkers> workers = nullptr)
+        : workers(std::move(workers)) {
+        for (Shard& shard : segments) {
+            shard.offset = total_rows;
+            total_rows += shard.segment->rows();
+            dimension = std::max(dimension, shard.segment->embeddings.dim());
+            deleted_count += shard.deleted_rows;
+            shards.push_back(std::move(shard));
+        }
+        scan_kernels = ScanKernels::for_stride(Corpus::padded_dim(dimension));
+    }
+
+    // Rows including deleted ones, which keep their global row until their
+    // segment is merged away; queries never return them.
+    Eigen::Index size() const { return total_rows; }
+    Eigen::Index deleted_rows() const { return deleted_count; }
+    Eigen::Index dim() const { return dimension; }
+    const std::vector<Shard>& corpus_shards() const { return shards; }
+    const std::shared_ptr<PartitionWorkers>& partition_workers() const { return workers; }
+    Eigen::Index stride() const { return Corpus::padded_dim(dimension); }
+    std::string_view image_path(Eigen::Index row) const {
+        const Shard& shard = shard_of(row);
+        return shard.segment->image_paths[row - shard.offset];
+    }
+
+    bool is_deleted(Eigen::Index row) const {
+        const Shard& shard = shard_of(row);
+        return shard.is_deleted(row - shard.offset);
+    }
+
+    // The global row of an image path as reported in results, if any. Later
+    // segments hold the newer rows.
+    std::optional<Eigen::Index> find_row(std::string_view path) const {
+        for (auto shard = shards.rbegin(); shard != shards.rend(); ++shard) {
+            auto it = shard->segment->rows_by_path.find(path);
+            if (it != shard->segment->rows_by_path.end() && !shard->is_deleted(it->second)) {
+                return shard->offset + it->second;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // A corpus row by global index, across shards, with its statistics; for
+    // jobs that walk the whole corpus. The data is zero padded to stride().
+    struct RowRef {
+        const float* data;
+        float sq_norm;
+        float inv_norm;
+    };
+
+    RowRef row(Eigen::Index global_row) const {
+        const Shard& shard = shard_of(global_row);
+        Eigen::Index local = global_row - shard.offset;
+        return {shard.embeddings().row(local), shard.row_stats().sq_norms(local), shard.row_stats().inv_norms(local)};
+    }
+
+    std::size_t corpus_bytes() const {
+        std::size_t bytes = 0;
+        for (const auto& shard : shards) {
+            bytes += shard.embeddings().bytes();
+        }
+        return bytes;
+    }
+
+    std::size_t huge_page_bytes() const {
+        std::size_t bytes = 0;
+        for (const auto& shard : shards) {
+            bytes += shard.embeddings().huge_page_bytes();
+        }
+        return bytes;
+    }
+
+    // Throws DeadlineExceeded if `deadline` passes before the scan finishes.
+    QueryResults query(const Eigen::VectorXf& query_embedding, int topk, const std::string& mode = "cosine",
+                       Deadline deadline = kNoDeadline) const {
+        QueryRequest request;
+        request.embedding = query_embedding;
+        request.topk = topk;
+        request.metric = parse_metric(mode);
+        request.deadline = deadline;
+        return query(request, QueryScratch::local());
+    }
+
+    // Runs the query entirely in `scratch` and returns its results, which
+    // stay valid until the next query on the same scratch. Once the scratch
+    // has grown to fit, an unsharded engine answers without heap allocation.
+    const QueryResults& query(const QueryRequest& request, QueryScratch& scratch) const {
+        if (request.examples) {
+            pad_examples(request.examples->vectors, scratch.examples);
+        } else {
+            pad_query(request.embedding, scratch.query);
+        }
+        dispatch_metric(request.metric, [&](auto metric) {
+            using Metric = decltype(metric);
+            query_impl<Metric>(scratch, request);
+            if (request.diversify) {
+                diversify(scratch, request.topk, request.diversify->lambda);
+            }
+            to_results<Metric>(scratch.heap, scratch.results);
+        });
+        return scratch.results;
+    }
+
+    // Whether query_batch scores `request` in its shared GEMM; the others
+    // gain nothing from being batched.
+    static bool batchable(const QueryRequest& request) {
+        return !request.diversify && !request.examples &&
+               dispatch_metric(request.metric, [](auto metric) { return decltype(metric)::supports_gemm; });
+    }
+
+    // Answers several queries at once. All queries whose metric can be
+    // expressed through x.q are scored by one blocked GEMM per shard, so the
+    // corpus is streamed from memory once for the whole batch; the others
+    // fall back to the per-query scan, as do diversified queries, whose
+    // candidate pool is reranked per query, and multi-vector queries, which
+    // are a GEMM of their own. A request that fails, by running past its
+    // deadline or being invalid, fails alone.
+    std::vector<BatchAnswer> query_batch(const std::vector<QueryRequest>& requests) const {
+        std::vector<BatchAnswer> results(requests.size());
+
+        std::vector<const QueryRequest*> gemm_requests;
+        std::vector<std::size_t> gemm_slots;
+        std::vector<Eigen::VectorXf> padded_queries;
+        for (std::size_t i = 0; i < requests.size(); ++i) {
+            try {
+                if (batchable(requests[i])) {
+                    Eigen::VectorXf& padded_query = padded_queries.emplace_back();
+                    pad_query(requests[i].embedding, padded_query);
+                    gemm_requests.push_back(&requests[i]);
+                    gemm_slots.push_back(i);
+                } else {
+                    results[i].results = query(requests[i], QueryScratch::local());
+                }
+            } catch (...) {
+                if (gemm_requests.size() < padded_queries.size()) {
+                    padded_queries.pop_back();
+                }
+                results[i].error = std::current_exception();
+            }
+        }
+        if (gemm_requests.empty()) {
+            return results;
+        }
+
+        Eigen::MatrixXf gemm_queries(Corpus::padded_dim(dimension), gemm_requests.size());
+        Eigen::VectorXf query_sq_norms(gemm_requests.size());
+        for (std::size_t j = 0; j < gemm_requests.size(); ++j) {
+            Eigen::VectorXf& padded_query = padded_queries[j];
+            query_sq_norms(j) = padded_query.squaredNorm();
+            dispatch_metric(gemm_requests[j]->metric, [&](auto metric) { decltype(metric)::prepare_query(padded_query); });
+            gemm_queries.col(j) = padded_query;
+        }
+
+        using Heaps = std::vector<std::vector<std::pair<float, int>>>;
+        std::vector<Heaps> partials(shards.size(), Heaps(gemm_requests.size()));
+        std::vector<std::vector<char>> expired(shards.size(), std::vector<char>(gemm_requests.size(), false));
+        for_each_shard([&](std::size_t s) {
+            scan_shard_batch(shards[s], gemm_queries, gemm_requests, query_sq_norms, partials[s], expired[s]);
+        });
+
+        for (std::size_t j = 0; j < gemm_requests.size(); ++j) {
+            bool timed_out = std::any_of(expired.begin(), expired.end(), [j](const std::vector<char>& e) { return e[j]; });
+            if (timed_out) {
+                results[gemm_slots[j]].error = std::make_exception_ptr(DeadlineExceeded());
+                continue;
+            }
+            dispatch_metric(gemm_requests[j]->metric, [&](auto metric) {
+                using Metric = decltype(metric);
+                std::vector<std::vector<std::pair<float, int>>> per_shard;
+                for (auto& heaps : partials) {
+                    per_shard.push_back(std::move(heaps[j]));
+                }
+                auto topk_indices = merge_topk<Metric>(per_shard, gemm_requests[j]->topk);
+                to_results<Metric>(topk_indices, results[gemm_slots[j]].results);
+            });
+        }
+        return results;
+    }
+
+private:
+    void init(std::vector<std::pair<Corpus, StringTable>> sharded, bool partitioned = false) {
+        for (std::size_t p = 0; p < sharded.size(); ++p) {
+            auto& [embeddings, paths] = sharded[p];
+            Shard shard;
+            shard.offset = total_rows;
+            shard.segment = std::make_shared<const Segment>(std::move(embeddings), std::move(paths), true,
+                                                            partitioned ? static_cast<int>(p) : -1);
+            total_rows += shard.segment->rows();
+            dimension = std::max(dimension, shard.segment->embeddings.dim());
+            shards.push_back(std::move(shard));
+        }
+        scan_kernels = ScanKernels::for_stride(Corpus::padded_dim(dimension));
+    }
+
+    const Shard& shard_of(Eigen::Index global_row) const {
+        if (shards.size() == 1) {
+            return shards.front();
+        }
+        return *(std::upper_bound(shards.begin(), shards.end(), global_row,
+                                  [](Eigen::Index r, const Shard& s) { return r < s.offset; }) - 1);
+    }
+};
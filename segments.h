@@ -0,0 +1,245 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "corpus.h"
+#include "query_engine.h"
+#include "string_table.h"
+#include "wal.h"
+
+// How a mutated collection lays out its segments, LSM style: new rows go to
+// a small memtable segment that is rebuilt with every group of mutations
+// and sealed once it reaches `memtable_rows`; sealed segments are never
+// written again. Deleting or replacing a row only marks it deleted in its
+// segment. In the background, `merge_factor` adjacent sealed segments of one
+// size tier (tier t holds memtable_rows * merge_factor^t live rows and more)
+// are merged into one, and a segment whose deleted share exceeds
+// `max_deleted_fraction` is rewritten without them. A group of mutations
+// thus costs at most one memtable copy plus one deleted-row map per segment
+// it deletes from, however large the collection. The shards a collection was
+// loaded into over NUMA partitions stay in their partition's memory and are
+// never merged or rewritten; rows deleted from them stay marked until the
+// collection is next reloaded.
+struct SegmentOptions {
+    Eigen::Index memtable_rows = 4096;
+    std::size_t merge_factor = 4;
+    double max_deleted_fraction = 0.25;
+};
+
+// A row copied into a new segment: `dim` floats and the row's file.
+struct SegmentRow {
+    const float* data;
+    Eigen::Index dim;
+    std::string_view path;
+};
+
+// Throws std::invalid_argument, before copying anything, if a row does not
+// have `dim` floats.
+inline std::shared_ptr<const Segment> build_segment(const std::vector<SegmentRow>& rows, Eigen::Index dim, bool sealed) {
+    for (const SegmentRow& row : rows) {
+        if (row.dim != dim) {
+            throw std::invalid_argument("Row " + std::string(row.path) + " has dimension " + std::to_string(row.dim) +
+                                        ", the segment " + std::to_string(dim));
+        }
+    }
+    Corpus embeddings(rows.size(), dim);
+    StringTable image_paths;
+    for (std::size_t r = 0; r < rows.size(); ++r) {
+        float* row = embeddings.row(r);
+        std::memcpy(row, rows[r].data, dim * sizeof(float));
+        std::fill(row + dim, row + embeddings.stride(), 0.0f);
+        image_paths.push_back(rows[r].path);
+    }
+    return std::make_shared<const Segment>(std::move(embeddings), std::move(image_paths), sealed);
+}
+
+// The rows of `shards` not marked deleted, in order.
+inline std::vector<SegmentRow> live_rows(const std::vector<QueryEngine::Shard>& shards) {
+    std::vector<SegmentRow> rows;
+    for (const auto& shard : shards) {
+        for (Eigen::Index r = 0; r < shard.segment->rows(); ++r) {
+            if (!shard.is_deleted(r)) {
+                rows.push_back({shard.embeddings().row(r), shard.embeddings().dim(), shard.segment->image_paths[r]});
+            }
+        }
+    }
+    return rows;
+}
+
+// The next engine after `mutations`, sharing every segment of `engine` but
+// the memtable. The current row of each touched file is marked deleted and
+// upserted files get a new row in the memtable. Throws
+// std::invalid_argument if an upsert does not match the engine's dimension,
+// as when an overlay is replayed over re-embedded source files.
+inline std::unique_ptr<QueryEngine> apply_mutations(const QueryEngine& engine, const std::vector<Mutation>& mutations,
+                                                    const SegmentOptions& options) {
+    std::map<std::string_view, const Mutation*> latest;
+    for (const Mutation& mutation : mutations) {
+        if (mutation.kind == Mutation::Kind::Upsert && mutation.embedding.size() != engine.dim()) {
+            throw std::invalid_argument("Upsert of " + mutation.file + " has dimension " + std::to_string(mutation.embedding.size()) +
+                                        ", the collection " + std::to_string(engine.dim()));
+        }
+        latest[mutation.file] = &mutation;
+    }
+    std::vector<QueryEngine::Shard> shards = engine.corpus_shards();
+
+    // Each segment's deleted-row map is copied at most once per group.
+    std::map<std::size_t, std::shared_ptr<std::vector<char>>> deleted;
+    for (const auto& [file, mutation] : latest) {
+        auto row = engine.find_row(file);
+        if (!row) {
+            continue;
+        }
+        std::size_t s = std::upper_bound(shards.begin(), shards.end(), *row,
+                                         [](Eigen::Index r, const QueryEngine::Shard& shard) { return r < shard.offset; }) -
+                        shards.begin() - 1;
+        auto& map = deleted[s];
+        if (!map) {
+            map = shards[s].deleted ? std::make_shared<std::vector<char>>(*shards[s].deleted)
+                                    : std::make_shared<std::vector<char>>(shards[s].segment->rows(), 0);
+        }
+        (*map)[*row - shards[s].offset] = 1;
+        shards[s].deleted_rows++;
+    }
+    for (auto& [s, map] : deleted) {
+        shards[s].deleted = std::move(map);
+    }
+
+    // The memtable is rebuilt from its live rows and the upserts.
+    std::vector<QueryEngine::Shard> memtable;
+    if (!shards.empty() && !shards.back().segment->sealed) {
+        memtable.push_back(std::move(shards.back()));
+        shards.pop_back();
+    }
+    std::vector<SegmentRow> rows = live_rows(memtable);
+    for (const auto& [file, mutation] : latest) {
+        if (mutation->kind == Mutation::Kind::Upsert) {
+            rows.push_back({mutation->embedding.data(), mutation->embedding.size(), file});
+        }
+    }
+    if (!rows.empty() || shards.empty()) {
+        QueryEngine::Shard shard;
+        shard.segment = build_segment(rows, engine.dim(), static_cast<Eigen::Index>(rows.size()) >= options.memtable_rows);
+        shards.push_back(std::move(shard));
+    }
+    return std::make_unique<QueryEngine>(std::move(shards), engine.partition_workers());
+}
+
+// Adjacent sealed segments [begin, end) of an engine to merge into one.
+struct MergePlan {
+    std::size_t begin = 0;
+    std::size_t end = 0;
+};
+
+// The next merge `engine` needs, if any: a sealed segment with too many
+// deleted rows first, else the newest run of merge_factor sealed segments
+// in the same size tier. Partition shards end a run and are never planned.
+inline std::optional<MergePlan> plan_merge(const QueryEngine& engine, const SegmentOptions& options) {
+    const auto& shards = engine.corpus_shards();
+    std::size_t sealed = shards.size();
+    if (sealed > 0 && !shards.back().segment->sealed) {
+        sealed--;
+    }
+    auto mergeable = [&](std::size_t s) { return shards[s].segment->partition < 0; };
+    for (std::size_t s = 0; s < sealed; ++s) {
+        if (mergeable(s) && shards[s].deleted_rows > options.max_deleted_fraction * shards[s].segment->rows()) {
+            return MergePlan{s, s + 1};
+        }
+    }
+    if (options.merge_factor < 2) {
+        return std::nullopt;
+    }
+    auto tier = [&](const QueryEngine::Shard& shard) {
+        double live = std::max<Eigen::Index>(1, shard.segment->rows() - shard.deleted_rows);
+        return static_cast<int>(std::floor(std::log(std::max(1.0, live / options.memtable_rows)) / std::log(options.merge_factor)));
+    };
+    std::optional<MergePlan> plan;
+    for (std::size_t begin = 0; begin < sealed;) {
+        if (!mergeable(begin)) {
+            begin++;
+            continue;
+        }
+        std::size_t end = begin + 1;
+        while (end < sealed && mergeable(end) && tier(shards[end]) == tier(shards[begin])) {
+            end++;
+        }
+        if (end - begin >= options.merge_factor) {
+            plan = MergePlan{begin, begin + options.merge_factor};
+        }
+        begin = end;
+    }
+    return plan;
+}
+
+// The live rows of `sources`, adjacent segments of an engine, as one sealed
+// segment. Built without locks, off the query path.
+inline std::shared_ptr<const Segment> merge_segments(const std::vector<QueryEngine::Shard>& sources, Eigen::Index dim) {
+    return build_segment(live_rows(sources), dim, true);
+}
+
+// `current` with `sources` replaced by `merged`, their merge, or null when
+// `current` no longer holds them (a reload replaced it meanwhile). Rows
+// deleted from the sources since the merge began are marked deleted in it.
+inline std::unique_ptr<QueryEngine> replace_segments(const QueryEngine& current, const std::vector<QueryEngine::Shard>& sources,
+                                                     std::shared_ptr<const Segment> merged) {
+    const auto& shards = current.corpus_shards();
+    auto first = std::find_if(shards.begin(), shards.end(),
+                              [&](const QueryEngine::Shard& shard) { return shard.segment == sources.front().segment; });
+    if (first == shards.end() || static_cast<std::size_t>(shards.end() - first) < sources.size()) {
+        return nullptr;
+    }
+    QueryEngine::Shard replacement;
+    std::vector<char> deleted;
+    Eigen::Index m = 0;
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        const QueryEngine::Shard& now = first[i];
+        if (now.segment != sources[i].segment) {
+            return nullptr;
+        }
+        for (Eigen::Index r = 0; r < now.segment->rows(); ++r) {
+            if (sources[i].is_deleted(r)) {
+                continue;
+            }
+            if (now.is_deleted(r)) {
+                deleted.resize(merged->rows(), 0);
+                deleted[m] = 1;
+                replacement.deleted_rows++;
+            }
+            m++;
+        }
+    }
+    replacement.segment = std::move(merged);
+    if (!deleted.empty()) {
+        replacement.deleted = std::make_shared<const std::vector<char>>(std::move(deleted));
+    }
+
+    std::vector<QueryEngine::Shard> next(shards.begin(), first);
+    if (replacement.segment->rows() > 0 || shards.size() == sources.size()) {
+        next.push_back(std::move(replacement));
+    }
+    next.insert(next.end(), first + sources.size(), shards.end());
+    return std::make_unique<QueryEngine>(std::move(next), current.partition_workers());
+}
+
+// A single-segment copy of `engine` without its deleted rows, for jobs that
+// walk every row, such as clustering.
+inline std::shared_ptr<const QueryEngine> without_deleted_rows(std::shared_ptr<const QueryEngine> engine) {
+    if (engine->deleted_rows() == 0) {
+        return engine;
+    }
+    QueryEngine::Shard shard;
+    shard.segment = merge_segments(engine->corpus_shards(), engine->dim());
+    std::vector<QueryEngine::Shard> shards;
+    shards.push_back(std::move(shard));
+    return std::make_shared<const QueryEngine>(std::move(shards));
+}
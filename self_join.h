@@ -0,0 +1,53 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "corpus.h"
+
+// Dot products of every row of a corpus with every other row, one tile at a
+// time. Rows are cut into blocks of `block_rows`; each pair of blocks (I, J)
+// with J >= I is a tile scored by one GEMM of the two row-major blocks, and
+// tiles are handed out to `threads` workers. A worker holds a single
+// block_rows x block_rows tile, so memory stays flat however large the
+// corpus. `visit(i_begin, j_begin, tile)` gets
+//   tile(a, b) = x[i_begin + a] . x[j_begin + b]
+// and is called concurrently from the workers. On diagonal tiles
+// (i_begin == j_begin) only entries with a < b are distinct pairs.
+using SelfJoinTile = Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+template <typename Visit>
+void for_each_self_join_tile(const Corpus& corpus, Eigen::Index block_rows, int threads, Visit&& visit) {
+    Eigen::Index blocks = (corpus.rows() + block_rows - 1) / block_rows;
+    std::vector<std::pair<Eigen::Index, Eigen::Index>> tiles;
+    for (Eigen::Index i = 0; i < blocks; ++i) {
+        for (Eigen::Index j = i; j < blocks; ++j) {
+            tiles.emplace_back(i * block_rows, j * block_rows);
+        }
+    }
+
+    std::atomic<std::size_t> next{0};
+    auto work = [&] {
+        SelfJoinTile tile;
+        for (std::size_t t = next++; t < tiles.size(); t = next++) {
+            auto [i_begin, j_begin] = tiles[t];
+            Corpus::MatrixView a(corpus.row(i_begin), std::min(block_rows, corpus.rows() - i_begin), corpus.stride());
+            Corpus::MatrixView b(corpus.row(j_begin), std::min(block_rows, corpus.rows() - j_begin), corpus.stride());
+            tile.noalias() = a * b.transpose();
+            visit(i_begin, j_begin, static_cast<const SelfJoinTile&>(tile));
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; ++t) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "file_cache.h"
+
+// Immutable-once-built strings stored back to back in one buffer and
+// addressed by index, so N paths cost two allocations instead of N and a
+// lookup hands out a string_view without copying. A table can be saved to
+// a file, or serialized into a larger one, and mapped back read-only; the
+// on-disk layout is
+//   "STRTAB1\0", count (u64), offsets (u64 x count+1), characters
+// and the mapped table reads straight from the page cache.
+class StringTable {
+public:
+    StringTable() = default;
+
+    void push_back(std::string_view value) {
+        to_owned();
+        owned_chars.append(value);
+        owned_offsets.push_back(owned_chars.size());
+    }
+
+    void append(const StringTable& other) {
+        for (std::size_t i = 0; i < other.size(); ++i) {
+            push_back(other[i]);
+        }
+    }
+
+    void reserve(std::size_t count, std::size_t chars) {
+        to_owned();
+        owned_offsets.reserve(count + 1);
+        owned_chars.reserve(chars);
+    }
+
+    std::size_t size() const { return mapping ? mapped_count : owned_offsets.size() - 1; }
+
+    std::string_view operator[](std::size_t i) const {
+        return std::string_view(chars() + offsets()[i], offsets()[i + 1] - offsets()[i]);
+    }
+
+    std::size_t bytes() const { return (size() + 1) * sizeof(std::uint64_t) + offsets()[size()]; }
+
+    // Appends the on-disk layout to `out`, for files that embed a table; it
+    // must start 8-byte aligned in the file to be mapped back.
+    void serialize(std::string& out) const {
+        std::uint64_t count = size();
+        out.append(kMagic, sizeof(kMagic));
+        out.append(reinterpret_cast<const char*>(&count), sizeof(count));
+        out.append(reinterpret_cast<const char*>(offsets()), (count + 1) * sizeof(std::uint64_t));
+        out.append(chars(), offsets()[count]);
+    }
+
+    void save(const std::string& path) const {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        std::uint64_t count = size();
+        file.write(kMagic, sizeof(kMagic));
+        file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        file.write(reinterpret_cast<const char*>(offsets()), (count + 1) * sizeof(std::uint64_t));
+        file.write(chars(), offsets()[count]);
+        if (!file) {
+            throw std::runtime_error("Could not write string table: " + path);
+        }
+    }
+
+    // Maps a table written by save(); the file must not change while mapped.
+    static StringTable load(const std::string& path) {
+        auto file = OpenFile::open(path);
+        if (!file) {
+            throw std::runtime_error("Not a string table: " + path);
+        }
+        std::size_t offset = 0;
+        return map(std::move(file), offset, path);
+    }
+
+    // Maps the table serialized at `offset` of `file`, named `path` in errors,
+    // and advances `offset` past it.
+    static StringTable map(std::shared_ptr<const OpenFile> file, std::size_t& offset, const std::string& path) {
+        constexpr std::size_t header = sizeof(kMagic) + sizeof(std::uint64_t);
+        if (offset % alignof(std::uint64_t) != 0 || offset > file->size || file->size - offset < header + sizeof(std::uint64_t) ||
+            std::memcmp(file->data + offset, kMagic, sizeof(kMagic)) != 0) {
+            throw std::runtime_error("Not a string table: " + path);
+        }
+        StringTable table;
+        std::memcpy(&table.mapped_count, file->data + offset + sizeof(kMagic), sizeof(std::uint64_t));
+        if (table.mapped_count >= (file->size - offset - header) / sizeof(std::uint64_t)) {
+            throw std::runtime_error("Truncated string table: " + path);
+        }
+        std::size_t chars_begin = offset + header + (table.mapped_count + 1) * sizeof(std::uint64_t);
+        table.mapped_offsets = reinterpret_cast<const std::uint64_t*>(file->data + offset + header);
+        table.mapped_chars = file->data + chars_begin;
+        if (table.mapped_offsets[table.mapped_count] > file->size - chars_begin) {
+            throw std::runtime_error("Truncated string table: " + path);
+        }
+        offset = chars_begin + table.mapped_offsets[table.mapped_count];
+        table.mapping = std::move(file);
+        return table;
+    }
+
+private:
+    static constexpr char kMagic[8] = {'S', 'T', 'R', 'T', 'A', 'B', '1', '\0'};
+
+    std::string owned_chars;
+    std::vector<std::uint64_t> owned_offsets{0};
+
+    std::shared_ptr<const OpenFile> mapping;
+    std::size_t mapped_count = 0;
+    const std::uint64_t* mapped_offsets = nullptr;
+    const char* mapped_chars = nullptr;
+
+    const std::uint64_t* offsets() const { return mapping ? mapped_offsets : owned_offsets.data(); }
+    const char* chars() const { return mapping ? mapped_chars : owned_chars.data(); }
+
+    // Appending to a mapped table first copies it into owned storage.
+    void to_owned() {
+        if (!mapping) {
+            return;
+        }
+        StringTable mapped = std::move(*this);
+        *this = StringTable();
+        owned_chars.assign(mapped.mapped_chars, mapped.mapped_offsets[mapped.mapped_count]);
+        owned_offsets.assign(mapped.mapped_offsets, mapped.mapped_offsets + mapped.mapped_count + 1);
+    }
+};
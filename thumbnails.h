@@ -0,0 +1,100 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "file_cache.h"
+
+// Downsized JPEGs packed by `python -m prepare_data prepare_thumbnails`:
+// <dir>/<size>.pack holds the thumbnails back to back and
+// <dir>/<size>.index.json maps each image path to [offset, length] in it.
+// Packs are mapped once at startup; rerunning the job needs a restart.
+class ThumbnailStore {
+public:
+    struct Thumbnail {
+        std::shared_ptr<const OpenFile> pack;
+        std::size_t offset = 0;
+        std::size_t length = 0;
+        std::string etag;
+    };
+
+    // Loads every pack in `directory`; a missing directory means no packs.
+    static ThumbnailStore load(const std::string& directory) {
+        ThumbnailStore store;
+        if (!std::filesystem::is_directory(directory)) {
+            return store;
+        }
+        for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+            if (entry.path().extension() != ".pack") {
+                continue;
+            }
+            std::string stem = entry.path().stem().string();
+            int size = std::atoi(stem.c_str());
+            std::ifstream index_file(entry.path().parent_path() / (stem + ".index.json"));
+            auto file = OpenFile::open(entry.path().string());
+            if (size <= 0 || !index_file.is_open() || !file) {
+                std::cerr << "Warning: Skipping thumbnail pack " << entry.path() << "\n";
+                continue;
+            }
+
+            Pack pack{size, file, {}};
+            nlohmann::json index;
+            index_file >> index;
+            for (const auto& [image_path, range] : index.items()) {
+                std::size_t offset = range.at(0).get<std::size_t>();
+                std::size_t length = range.at(1).get<std::size_t>();
+                if (offset + length <= file->size) {
+                    pack.index.emplace(image_path, std::make_pair(offset, length));
+                }
+            }
+            store.packs.push_back(std::move(pack));
+        }
+        std::sort(store.packs.begin(), store.packs.end(), [](const Pack& a, const Pack& b) { return a.size < b.size; });
+        return store;
+    }
+
+    // The smallest thumbnail of at least `size` pixels, or nullopt if no pack
+    // is that large or the image is not in one.
+    std::optional<Thumbnail> find(const std::string& image_path, int size) const {
+        for (const auto& pack : packs) {
+            if (pack.size < size) {
+                continue;
+            }
+            auto it = pack.index.find(image_path);
+            if (it == pack.index.end()) {
+                continue;
+            }
+            auto [offset, length] = it->second;
+            std::string etag = pack.file->etag;
+            etag.insert(etag.size() - 1, "-" + std::to_string(offset));
+            return Thumbnail{pack.file, offset, length, etag};
+        }
+        return std::nullopt;
+    }
+
+    std::vector<int> sizes() const {
+        std::vector<int> sizes;
+        for (const auto& pack : packs) {
+            sizes.push_back(pack.size);
+        }
+        return sizes;
+    }
+
+private:
+    struct Pack {
+        int size;
+        std::shared_ptr<const OpenFile> file;
+        std::unordered_map<std::string, std::pair<std::size_t, std::size_t>> index;
+    };
+
+    std::vector<Pack> packs;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// Bounded top-k. The heap holds at most k entries with the current worst
+// candidate on top, so each row costs one comparison in the common case
+// instead of a push into an N-sized heap. push_topk/finish_topk let callers
+// feed scores incrementally, e.g. block by block; results are best first.
+// Equal scores rank by row, so the order is total and pages cut from it
+// neither repeat nor skip rows.
+template <typename Metric>
+bool topk_better(const std::pair<float, int>& a, const std::pair<float, int>& b) {
+    if (a.first != b.first) {
+        return Metric::higher_is_better ? a.first > b.first : a.first < b.first;
+    }
+    return a.second < b.second;
+}
+
+// Whether `score` is at least as good as `bound`, e.g. a similarity at or
+// above a minimum or a distance within a radius.
+template <typename Metric>
+bool within_bound(float score, float bound) {
+    return Metric::higher_is_better ? score >= bound : score <= bound;
+}
+
+template <typename Metric>
+void push_topk(std::vector<std::pair<float, int>>& heap, int topk, float score, int idx) {
+    std::pair<float, int> candidate(score, idx);
+    if (static_cast<int>(heap.size()) < topk) {
+        heap.push_back(candidate);
+        std::push_heap(heap.begin(), heap.end(), topk_better<Metric>);
+    } else if (topk > 0 && topk_better<Metric>(candidate, heap.front())) {
+        std::pop_heap(heap.begin(), heap.end(), topk_better<Metric>);
+        heap.back() = candidate;
+        std::push_heap(heap.begin(), heap.end(), topk_better<Metric>);
+    }
+}
+
+template <typename Metric>
+void finish_topk(std::vector<std::pair<float, int>>& heap) {
+    std::sort_heap(heap.begin(), heap.end(), topk_better<Metric>);
+}
+
+template <typename Metric>
+std::vector<std::pair<float, int>> select_topk(const Eigen::VectorXf& scores, int topk) {
+    std::vector<std::pair<float, int>> heap;
+    if (topk <= 0) {
+        return heap;
+    }
+    heap.reserve(std::min<Eigen::Index>(topk, scores.size()));
+
+    for (int i = 0; i < scores.size(); ++i) {
+        push_topk<Metric>(heap, topk, scores(i), i);
+    }
+
+    finish_topk<Metric>(heap);
+    return heap;
+}
+
+// Merges per-shard top-k lists (each best first) into the global top-k,
+// reusing the storage of `merged`.
+template <typename Metric>
+void merge_topk(const std::vector<std::vector<std::pair<float, int>>>& partials, int topk,
+                std::vector<std::pair<float, int>>& merged) {
+    merged.clear();
+    for (const auto& partial : partials) {
+        merged.insert(merged.end(), partial.begin(), partial.end());
+    }
+
+    std::size_t keep = std::min<std::size_t>(std::max(topk, 0), merged.size());
+    std::partial_sort(merged.begin(), merged.begin() + keep, merged.end(), topk_better<Metric>);
+    merged.resize(keep);
+}
+
+template <typename Metric>
+std::vector<std::pair<float, int>> merge_topk(const std::vector<std::vector<std::pair<float, int>>>& partials, int topk) {
+    std::vector<std::pair<float, int>> merged;
+    merge_topk<Metric>(partials, topk, merged);
+    return merged;
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <Eigen/Dense>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+// One change to a collection, keyed by the image path reported as "file".
+// An upsert replaces the row of that file or adds it; a delete removes it.
+struct Mutation {
+    enum class Kind : std::uint8_t { Upsert = 1, Delete = 2 };
+    Kind kind = Kind::Upsert;
+    std::string file;
+    Eigen::VectorXf embedding;  // empty for deletes
+};
+
+// CRC-32 (IEEE) of `data`, continuing from `crc`.
+inline std::uint32_t crc32(const char* data, std::size_t size, std::uint32_t crc = 0) {
+    static const std::array<std::uint32_t, 256> table = [] {
+        std::array<std::uint32_t, 256> t{};
+        for (std::uint32_t i = 0; i < 256; ++i) {
+            std::uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (std::size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Append-only log of mutations. Every record is
+//   payload length (u32), CRC-32 of the payload (u32),
+//   payload: sequence number (u64), kind (u8), file length (u32), file,
+//            dimension (u32), floats x dimension
+// so a record cut short by a crash, or garbage after it, fails its length
+// or checksum; replay stops there and the tail is truncated away. append()
+// writes a whole group of records with one write and one fdatasync: the
+// group commit that amortizes the flush over concurrent writers. A group
+// that fails to write or sync is cut off again, so its sequence numbers can
+// be reused; if even that fails, the log refuses every later append.
+class WriteAheadLog {
+public:
+    explicit WriteAheadLog(std::string path) : path(std::move(path)) {
+        fd = ::open(this->path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "Could not open " + this->path);
+        }
+        bytes_ = ::lseek(fd, 0, SEEK_END);
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    ~WriteAheadLog() { ::close(fd); }
+
+    // Reads the records with a sequence number above `after` from the log at
+    // `path`, in order, and cuts the file after the last intact record.
+    static std::vector<std::pair<std::uint64_t, Mutation>> replay(const std::string& path, std::uint64_t after) {
+        std::vector<std::pair<std::uint64_t, Mutation>> records;
+        int in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0) {
+            return records;
+        }
+        std::string contents;
+        char buffer[1 << 16];
+        for (ssize_t n; (n = ::read(in, buffer, sizeof(buffer))) > 0;) {
+            contents.append(buffer, n);
+        }
+        ::close(in);
+
+        std::size_t offset = 0;
+        while (offset + 8 <= contents.size()) {
+            std::uint32_t length, checksum;
+            std::memcpy(&length, contents.data() + offset, 4);
+            std::memcpy(&checksum, contents.data() + offset + 4, 4);
+            if (length > contents.size() - offset - 8 || crc32(contents.data() + offset + 8, length) != checksum) {
+                break;
+            }
+            std::uint64_t sequence;
+            Mutation mutation;
+            if (!decode(std::string_view(contents.data() + offset + 8, length), sequence, mutation)) {
+                break;
+            }
+            if (sequence > after) {
+                records.emplace_back(sequence, std::move(mutation));
+            }
+            offset += 8 + length;
+        }
+        if (offset < contents.size() && ::truncate(path.c_str(), offset) != 0) {
+            throw std::system_error(errno, std::generic_category(), "Could not truncate " + path);
+        }
+        return records;
+    }
+
+    // Appends records numbered first_sequence, first_sequence + 1, ... and
+    // returns once they are on stable storage. On failure none of them stay
+    // in the log.
+    void append(const std::vector<Mutation>& mutations, std::uint64_t first_sequence) {
+        if (failed_) {
+            throw std::runtime_error("Write-ahead log " + path + " failed to roll back a write; refusing to append");
+        }
+        std::string out;
+        for (std::size_t i = 0; i < mutations.size(); ++i) {
+            encode(out, first_sequence + i, mutations[i]);
+        }
+        try {
+            for (std::size_t written = 0; written < out.size();) {
+                ssize_t n = ::write(fd, out.data() + written, out.size() - written);
+                if (n < 0 && errno != EINTR) {
+                    throw std::system_error(errno, std::generic_category(), "Could not write " + path);
+                }
+                written += n > 0 ? n : 0;
+            }
+            sync();
+        } catch (...) {
+            roll_back();
+            throw;
+        }
+        bytes_ += out.size();
+    }
+
+    // Empties the log once a checkpoint covers all of it.
+    void clear() {
+        if (::ftruncate(fd, 0) != 0) {
+            throw std::system_error(errno, std::generic_category(), "Could not truncate " + path);
+        }
+        try {
+            sync();
+        } catch (...) {
+            // The log may or may not be empty on disk now.
+            failed_ = true;
+            throw;
+        }
+        bytes_ = 0;
+    }
+
+    std::size_t bytes() const { return bytes_; }
+
+    // Whether a failed append could not be cut off again.
+    bool failed() const { return failed_; }
+
+private:
+    std::string path;
+    int fd = -1;
+    std::size_t bytes_ = 0;
+    bool failed_ = false;
+
+    // Cuts the log back to its last good group, durably, after a failed
+    // append. The file is opened O_APPEND, so the next write lands at the
+    // new end without a seek.
+    void roll_back() {
+        if (::ftruncate(fd, bytes_) != 0) {
+            failed_ = true;
+            return;
+        }
+        try {
+            sync();
+        } catch (...) {
+            failed_ = true;
+        }
+    }
+
+    void sync() {
+#ifdef __linux__
+        int result = ::fdatasync(fd);
+#else
+        int result = ::fsync(fd);
+#endif
+        if (result != 0) {
+            throw std::system_error(errno, std::generic_category(), "Could not sync " + path);
+        }
+    }
+
+    template <typename T>
+    static void put(std::string& out, T value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static void encode(std::string& out, std::uint64_t sequence, const Mutation& mutation) {
+        std::size_t header = out.size();
+        out.append(8, '\0');
+        put(out, sequence);
+        put(out, static_cast<std::uint8_t>(mutation.kind));
+        put(out, static_cast<std::uint32_t>(mutation.file.size()));
+        out.append(mutation.file);
+        put(out, static_cast<std::uint32_t>(mutation.embedding.size()));
+        out.append(reinterpret_cast<const char*>(mutation.embedding.data()), mutation.embedding.size() * sizeof(float));
+
+        std::uint32_t length = out.size() - header - 8;
+        std::uint32_t checksum = crc32(out.data() + header + 8, length);
+        std::memcpy(&out[header], &length, 4);
+        std::memcpy(&out[header + 4], &checksum, 4);
+    }
+
+    static bool decode(std::string_view payload, std::uint64_t& sequence, Mutation& mutation) {
+        std::size_t offset = 0;
+        auto get = [&](void* value, std::size_t size) {
+            if (size > payload.size() - offset) {
+                return false;
+            }
+            std::memcpy(value, payload.data() + offset, size);
+            offset += size;
+            return true;
+        };
+        std::uint8_t kind;
+        std::uint32_t file_size, dim;
+        if (!get(&sequence, 8) || !get(&kind, 1) || !get(&file_size, 4) || file_size > payload.size() - offset) {
+            return false;
+        }
+        mutation.kind = static_cast<Mutation::Kind>(kind);
+        mutation.file.assign(payload.data() + offset, file_size);
+        offset += file_size;
+        if (!get(&dim, 4) || dim * sizeof(float) != payload.size() - offset) {
+            return false;
+        }
+        mutation.embedding.resize(dim);
+        return get(mutation.embedding.data(), dim * sizeof(float));
+    }
+};